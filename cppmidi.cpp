@@ -2,11 +2,22 @@
 #include <stdexcept>
 #include <fstream>
 #include <typeinfo>
+#include <cmath>
+#include <atomic>
+#include <unordered_map>
 
 #include <cstring>
 #include <cstdarg>
 #include <cassert>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define CPPMIDI_HAVE_MMAP
+#endif
+
 #include "cppmidi.h"
 
 // #include <cstdio>
@@ -32,83 +43,70 @@ static std::string byte2str(uint8_t b) {
 
 // converts an uint to a [v]ariable [l]ength [v]alue
 std::vector<uint8_t> cppmidi::len2vlv(uint64_t len) {
-    if (len >= (1uLL << 28)) {
-        // 5 byte vlv
-        std::vector<uint8_t> retval = {
-            static_cast<uint8_t>((len >> 28) | 0x80),
-            static_cast<uint8_t>(((len >> 21) & 0x7F) | 0x80),
-            static_cast<uint8_t>(((len >> 14) & 0x7F) | 0x80),
-            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
-            static_cast<uint8_t>(len & 0x7F)
-        };
-        return retval;
-    } else if (len >= (1 << 21)) {
-        // 4 byte vlv
-        std::vector<uint8_t> retval = {
-            static_cast<uint8_t>((len >> 21) | 0x80),
-            static_cast<uint8_t>(((len >> 14) & 0x7F) | 0x80),
-            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
-            static_cast<uint8_t>(len & 0x7F)
-        };
-        return retval;
-    } else if (len >= (1 << 14)) {
-        // 3 byte vlv
-        std::vector<uint8_t> retval = {
-            static_cast<uint8_t>((len >> 14) | 0x80),
-            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
-            static_cast<uint8_t>(len & 0x7F)
-        };
-        return retval;
-    } else if (len >= (1 << 7)) {
-        // 2 byte vlv
-        std::vector<uint8_t> retval = {
-            static_cast<uint8_t>((len >> 7) | 0x80),
-            static_cast<uint8_t>(len & 0x7F)
-        };
-        return retval;
-    } else {
-        // 1 byte vlv
-        std::vector<uint8_t> retval = {
-            static_cast<uint8_t>(len & 0x7F)
-        };
-        return retval;
-    }
+    if (len >> 32)
+        throw xcept("len2vlv: len > 32 bits");
+    uint8_t vlv[max_vlv_size];
+    size_t size = encode_vlv(static_cast<uint32_t>(len), vlv);
+    return std::vector<uint8_t>(vlv, vlv + size);
 }
 
 // converts a [v]ariable [l]ength [v]alue to a uint
 uint32_t cppmidi::vlv2len(const std::vector<uint8_t>& vlv) {
-    if (vlv.size() > 5)
-        throw xcept("vlv2len: vlv > 5 bytes");
-    uint32_t retval = 0;
-    unsigned int i = 1;
-    for (uint8_t x : vlv) {
-        if (i == 5 && (x & 0x70))
-            throw xcept("vlv2len: resulting int > 32 bits");
-        if (i == vlv.size()) {
-            if (x & 0x80)
-                throw xcept("vlv2len: len bit set on last byte");
-        } else {
-            if (!(x & 0x80))
-                throw xcept("vlv2len: len bit not set on preceding bytes");
-        }
-        retval = static_cast<uint32_t>((x & 0x7F) | (retval << 7));
-        i += 1;
-    }
+    if (vlv.empty())
+        return 0;
+    uint32_t retval;
+    size_t size = decode_vlv(vlv.data(), vlv.data() + vlv.size(), retval);
+    if (size == 0)
+        throw xcept("vlv2len: invalid or too big vlv");
+    if (size != vlv.size())
+        throw xcept("vlv2len: len bit not set on preceding bytes");
     return retval;
 }
 
 uint32_t cppmidi::read_vlv(const std::vector<uint8_t>& midi_data, size_t& fpos) {
-    uint32_t retval = 0;
-    do {
-        if (retval >= 0x10000000)
-            throw xcept("Failed to read VLV (too big) at 0x%zx", fpos);
-        retval = static_cast<uint32_t>((midi_data.at(fpos) & 0x7F) |
-                (retval << 7));
-        // range check below is not required because we already checked it
-    } while (midi_data[fpos++] & 0x80);
+    uint32_t retval;
+    size_t size = fpos < midi_data.size() ? decode_vlv(midi_data.data() + fpos,
+            midi_data.data() + midi_data.size(), retval) : 0;
+    if (size == 0)
+        throw xcept("Failed to read VLV (too big or cut off) at 0x%zx", fpos);
+    fpos += size;
     return retval;
 }
 
+size_t cppmidi::decode_vlvs(const uint8_t *data, const uint8_t *end, uint32_t *values,
+        size_t count) {
+    const uint8_t *pos = data;
+    size_t i = 0;
+#if (defined(__GNUC__) || defined(__clang__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // Looks at eight bytes at once. Bytes before the first one with the
+    // continuation bit set are complete VLVs (most delta times are).
+    while (count - i >= 8 && end - pos >= 8) {
+        uint64_t word;
+        std::memcpy(&word, pos, sizeof(word));
+        uint64_t continued = word & 0x8080808080808080;
+        size_t singles = continued ? static_cast<size_t>(__builtin_ctzll(continued)) / 8 : 8;
+        for (size_t k = 0; k < singles; k++)
+            values[i + k] = static_cast<uint8_t>(word >> (8 * k));
+        pos += singles;
+        i += singles;
+        if (singles == 8)
+            continue;
+        size_t size = decode_vlv(pos, end, values[i]);
+        if (size == 0)
+            throw xcept("Failed to decode VLV %zu of %zu", i, count);
+        pos += size;
+        i++;
+    }
+#endif
+    for (; i < count; i++) {
+        size_t size = decode_vlv(pos, end, values[i]);
+        if (size == 0)
+            throw xcept("Failed to decode VLV %zu of %zu", i, count);
+        pos += size;
+    }
+    return static_cast<size_t>(pos - data);
+}
+
 std::unique_ptr<cppmidi::midi_event> cppmidi::read_event(
         const std::vector<uint8_t>& midi_data,
         size_t& fpos, uint8_t& current_midi_channel, running_state& current_rs,
@@ -401,7 +399,7 @@ std::unique_ptr<cppmidi::midi_event> cppmidi::read_event(
                     throw xcept("MIDI parser error: Unable to Read ongoing SysEx Terminal "
                             "at 0x%X", fpos);
                 }
-                if (data[data.size() - 1] == 0x7F)
+                if (data[data.size() - 1] == 0xF7)
                     sysex_ongoing = false;
                 retval = std::make_unique<sysex_midi_event>(current_tick,
                         std::move(data), false);
@@ -422,7 +420,7 @@ std::unique_ptr<cppmidi::midi_event> cppmidi::read_event(
                 throw xcept("MIDI parser error: Unable to Read SysEx Terminal "
                         "at 0x%X", fpos);
             }
-            if (data[data.size() - 1] == 0x7F)
+            if (data[data.size() - 1] == 0xF7)
                 sysex_ongoing = false;
             else
                 sysex_ongoing = true;
@@ -610,8 +608,8 @@ static void load_type_one(const std::vector<uint8_t>& midi_data, cppmidi::midi_f
     }
 }
 
-void cppmidi::midi_file::load_from_file(const std::filesystem::path& file_path) {
-    // read file
+static std::vector<uint8_t> read_file(const std::filesystem::path& file_path) {
+    using namespace cppmidi;
     std::ifstream is(file_path, std::ios_base::binary);
     // reading errno here is a bit hacky, but it does kinda work
     if (!is.is_open())
@@ -631,7 +629,22 @@ void cppmidi::midi_file::load_from_file(const std::filesystem::path& file_path)
     if (is.fail())
         throw xcept("std::ifstream::read fail");
     is.close();
+    return midi_data;
+}
+
+void cppmidi::midi_file::load_from_file(const std::filesystem::path& file_path) {
+    load_from_data(read_file(file_path));
+}
+
+void cppmidi::midi_file::load_from_file(const std::filesystem::path& file_path,
+        const channel_message_map& map) {
+    std::vector<uint8_t> midi_data = read_file(file_path);
+    raw_midi_data raw(midi_data.data(), midi_data.size());
+    map.apply(raw);
+    load_from_data(midi_data);
+}
 
+void cppmidi::midi_file::load_from_data(const std::vector<uint8_t>& midi_data) {
     // check header magics
     throw_assert(midi_data.at(0), 'M', "Bad MIDI magic");
     throw_assert(midi_data.at(1), 'T', "Bad MIDI magic");
@@ -664,7 +677,155 @@ void cppmidi::midi_file::load_from_file(const std::filesystem::path& file_path)
         load_type_one(midi_data, *this);
 }
 
-void cppmidi::midi_file::save_to_file(const std::filesystem::path& file_path) const {
+static void write_file(const std::filesystem::path& file_path,
+        const std::vector<uint8_t>& data, const char *open_error_fmt) {
+    std::ofstream fout(file_path, std::ios::out | std::ios::binary);
+    if (!fout.is_open())
+        throw cppmidi::xcept(open_error_fmt, strerror(errno));
+    fout.write(reinterpret_cast<const char*>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+    if (fout.bad())
+        throw cppmidi::xcept("std::ofstream::write bad");
+    if (fout.fail())
+        throw cppmidi::xcept("std::ofstream::write fail");
+    fout.close();
+}
+
+// appends delta time and event data, omitting the status byte if running status applies
+static void encode_track_event(std::vector<uint8_t>& data, const cppmidi::midi_event& ev,
+        uint32_t& last_event_time, uint8_t& running_status) {
+    std::vector<uint8_t> ev_data = ev.event_data();
+    uint8_t vlv[cppmidi::max_vlv_size];
+    size_t vlv_size = cppmidi::encode_vlv(ev.ticks - last_event_time, vlv);
+    last_event_time = ev.ticks;
+    data.insert(data.end(), vlv, vlv + vlv_size);
+
+    auto ev_begin = ev_data.begin();
+    uint8_t status = ev_data.at(0);
+    if (status >= 0xF0) {
+        // meta and sysex events cancel running status
+        running_status = 0;
+    } else if (status == running_status) {
+        ev_begin++;
+    } else {
+        running_status = status;
+    }
+    data.insert(data.end(), ev_begin, ev_data.end());
+}
+
+namespace {
+    // Encodes events into a single MTrk chunk. Takes care of delta times,
+    // running status and the terminating end of track event.
+    class track_encoder {
+    public:
+        explicit track_encoder(std::vector<uint8_t>& data)
+            : data(data), last_event_time(0), eot_time(0), running_status(0) {
+            data.push_back(static_cast<uint8_t>('M'));
+            data.push_back(static_cast<uint8_t>('T'));
+            data.push_back(static_cast<uint8_t>('r'));
+            data.push_back(static_cast<uint8_t>('k'));
+
+            // spaceholder for track length
+            track_len_pos = data.size();
+            data.push_back(0);
+            data.push_back(0);
+            data.push_back(0);
+            data.push_back(0);
+            track_start_pos = data.size();
+        }
+
+        // returns false if ev is an end of track event, which is not written
+        bool add(const cppmidi::midi_event& ev) {
+            if (ev.kind() == cppmidi::event_kind::EndOfTrack) {
+                eot_time = std::max(eot_time, ev.ticks);
+                return false;
+            }
+            encode_track_event(data, ev, last_event_time, running_status);
+            return true;
+        }
+
+        void finish() {
+            uint8_t vlv[cppmidi::max_vlv_size];
+            size_t vlv_size = cppmidi::encode_vlv(
+                    std::max(eot_time, last_event_time) - last_event_time, vlv);
+            std::vector<uint8_t> eot_data = cppmidi::endoftrack_meta_midi_event(0).event_data();
+            data.insert(data.end(), vlv, vlv + vlv_size);
+            data.insert(data.end(), eot_data.begin(), eot_data.end());
+
+            size_t track_len = data.size() - track_start_pos;
+            data[track_len_pos + 0] = static_cast<uint8_t>(track_len >> 24);
+            data[track_len_pos + 1] = static_cast<uint8_t>(track_len >> 16);
+            data[track_len_pos + 2] = static_cast<uint8_t>(track_len >> 8);
+            data[track_len_pos + 3] = static_cast<uint8_t>(track_len >> 0);
+        }
+    private:
+        std::vector<uint8_t>& data;
+        size_t track_len_pos;
+        size_t track_start_pos;
+        uint32_t last_event_time;
+        uint32_t eot_time;
+        uint8_t running_status;
+    };
+
+    // Calls f(i) for every i < count on a pool of threads. Small amounts of
+    // work (the sum of all items, e.g. the number of events) are done on the
+    // calling thread. The first exception thrown by f is rethrown.
+    template<typename F>
+    void parallel_for(size_t count, size_t work, F f) {
+        const size_t min_parallel_work = 1 << 16;
+        size_t num_threads = std::min<size_t>(std::thread::hardware_concurrency(), count);
+        if (num_threads <= 1 || work < min_parallel_work) {
+            for (size_t i = 0; i < count; i++)
+                f(i);
+            return;
+        }
+
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_mtx;
+        auto worker = [&]() {
+            for (size_t i; (i = next.fetch_add(1)) < count;) {
+                try {
+                    f(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mtx);
+                    if (!error)
+                        error = std::current_exception();
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < num_threads; t++)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread& t : threads)
+            t.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+static void save_type_zero(const cppmidi::midi_file& mf, std::vector<uint8_t>& data) {
+    using namespace cppmidi;
+    track_encoder enc(data);
+
+    // events after the end of track are ignored, like for type 1 files
+    std::vector<bool> track_ended(mf.midi_tracks.size(), false);
+    for (merged_event mev : merged_event_stream(mf)) {
+        if (track_ended[mev.track])
+            continue;
+        if (!enc.add(*mev.event))
+            track_ended[mev.track] = true;
+    }
+
+    enc.finish();
+}
+
+void cppmidi::midi_file::save_to_file(const std::filesystem::path& file_path,
+        uint16_t midi_type, bool reuse_chunks) const {
+    if (midi_type > 1)
+        throw xcept("Saving MIDI file type %u is not supported", midi_type);
+
     std::vector<uint8_t> data;
     // file magic
     data.push_back(static_cast<uint8_t>('M'));
@@ -678,69 +839,100 @@ void cppmidi::midi_file::save_to_file(const std::filesystem::path& file_path) co
     data.push_back(0);
     data.push_back(6);
 
-    // midi type #1
-    data.push_back(0);
-    data.push_back(1);
+    // midi type
+    data.push_back(static_cast<uint8_t>(midi_type >> 8));
+    data.push_back(static_cast<uint8_t>(midi_type));
 
     // num tracks
-    data.push_back(static_cast<uint8_t>(midi_tracks.size() >> 8));
-    data.push_back(static_cast<uint8_t>(midi_tracks.size()));
+    size_t num_tracks = (midi_type == 0) ? 1 : midi_tracks.size();
+    data.push_back(static_cast<uint8_t>(num_tracks >> 8));
+    data.push_back(static_cast<uint8_t>(num_tracks));
 
     // time division
     data.push_back(static_cast<uint8_t>(time_division >> 8));
     data.push_back(static_cast<uint8_t>(time_division));
 
-    std::vector<uint8_t> zero_vlv = len2vlv(0);
-    std::vector<uint8_t> eot_data = endoftrack_meta_midi_event(0).event_data();
+    if (midi_type == 0) {
+        save_type_zero(*this, data);
+    } else {
+        for (const midi_track& mtrk : midi_tracks)
+            mtrk.encode_chunk(data, reuse_chunks);
+    }
 
-    for (size_t trk = 0; trk < midi_tracks.size(); trk++) {
-        // track header
-        data.push_back(static_cast<uint8_t>('M'));
-        data.push_back(static_cast<uint8_t>('T'));
-        data.push_back(static_cast<uint8_t>('r'));
-        data.push_back(static_cast<uint8_t>('k'));
-
-        // spaceholder for
-        uint32_t track_len_pos = static_cast<uint32_t>(data.size());
-        data.push_back(0);
-        data.push_back(0);
-        data.push_back(0);
-        data.push_back(0);
-
-        // event data
-        uint32_t track_start_pos = static_cast<uint32_t>(data.size());
-        uint32_t last_event_time = 0;
-        for (const auto& ev : midi_tracks[trk]) {
-            std::vector<uint8_t> ev_data = ev->event_data();
-            if (typeid(*ev) == typeid(endoftrack_meta_midi_event))
+    write_file(file_path, data, "Error saving MIDI File: %s");
+}
+
+void cppmidi::midi_track::encode_chunk(std::vector<uint8_t>& data, bool use_cache) const {
+    if (!use_cache) {
+        track_encoder enc(data);
+        for (const auto& ev : midi_events) {
+            if (!enc.add(*ev))
                 break;
-            uint32_t event_time = ev->ticks;
-            std::vector<uint8_t> vlv = len2vlv(event_time - last_event_time);
-            last_event_time = event_time;
-            data.insert(data.end(), vlv.begin(), vlv.end());
-            data.insert(data.end(), ev_data.begin(), ev_data.end());
         }
-        data.insert(data.end(), zero_vlv.begin(), zero_vlv.end());
-        data.insert(data.end(), eot_data.begin(), eot_data.end());
+        enc.finish();
+        return;
+    }
 
-        uint32_t track_end_pos = static_cast<uint32_t>(data.size());
-        uint32_t track_len = track_end_pos - track_start_pos;
-        data[track_len_pos + 0] = static_cast<uint8_t>(track_len >> 24);
-        data[track_len_pos + 1] = static_cast<uint8_t>(track_len >> 16);
-        data[track_len_pos + 2] = static_cast<uint8_t>(track_len >> 8);
-        data[track_len_pos + 3] = static_cast<uint8_t>(track_len >> 0);
+    std::lock_guard<std::mutex> lock(cache_mtx.mtx);
+    if (!stamp_matches(encoded_chunk_stamp)) {
+        encoded_chunk_cache.clear();
+        encoded_chunk_stamp = cache_stamp();
+        track_encoder enc(encoded_chunk_cache);
+        for (const auto& ev : midi_events) {
+            if (!enc.add(*ev))
+                break;
+        }
+        enc.finish();
+        encoded_chunk_stamp = current_stamp();
     }
+    data.insert(data.end(), encoded_chunk_cache.begin(), encoded_chunk_cache.end());
+}
 
-    std::ofstream fout(file_path, std::ios::out | std::ios::binary);
-    if (!fout.is_open())
-        throw xcept("Error saving MIDI File: %s", strerror(errno));
-    fout.write(reinterpret_cast<char*>(data.data()),
-            static_cast<std::streamsize>(data.size()));
-    if (fout.bad())
-        throw xcept("std::ofstream::write bad");
-    if (fout.fail())
-        throw xcept("std::ofstream::write fail");
-    fout.close();
+size_t cppmidi::midi_track::lower_bound(uint32_t ticks) const {
+    std::lock_guard<std::mutex> lock(cache_mtx.mtx);
+    if (!stamp_matches(seek_index_stamp)) {
+        seek_index.clear();
+        seek_index_stamp = cache_stamp();
+        seek_index.reserve(midi_events.size() / seek_index_stride + 1);
+        for (size_t i = 0; i < midi_events.size(); i++) {
+            if (i > 0 && midi_events[i]->ticks < midi_events[i - 1]->ticks)
+                throw xcept("Cannot seek in track: events are not sorted");
+            if (i % seek_index_stride == 0)
+                seek_index.push_back(midi_events[i]->ticks);
+        }
+        seek_index_stamp = current_stamp();
+    }
+
+    // the first sample >= ticks limits the result to the block before it
+    size_t sample = static_cast<size_t>(
+            std::lower_bound(seek_index.begin(), seek_index.end(), ticks) - seek_index.begin());
+    if (sample == 0)
+        return 0;
+    size_t first = (sample - 1) * seek_index_stride + 1;
+    size_t last = std::min(sample * seek_index_stride, midi_events.size());
+    auto it = std::partition_point(midi_events.begin() + static_cast<ptrdiff_t>(first),
+            midi_events.begin() + static_cast<ptrdiff_t>(last),
+            [ticks](const std::unique_ptr<midi_event>& ev) { return ev->ticks < ticks; });
+    return static_cast<size_t>(it - midi_events.begin());
+}
+
+void cppmidi::midi_track::build_kind_index() const {
+    std::lock_guard<std::mutex> lock(cache_mtx.mtx);
+    if (stamp_matches(kind_index_stamp))
+        return;
+
+    // counting sort of the positions by kind
+    kind_index_offsets.fill(0);
+    for (const auto& ev : midi_events)
+        kind_index_offsets[static_cast<size_t>(ev->kind()) + 1]++;
+    for (size_t k = 0; k < num_event_kinds; k++)
+        kind_index_offsets[k + 1] += kind_index_offsets[k];
+    kind_index_positions.resize(midi_events.size());
+    std::array<size_t, num_event_kinds> next;
+    std::copy(kind_index_offsets.begin(), kind_index_offsets.end() - 1, next.begin());
+    for (size_t i = 0; i < midi_events.size(); i++)
+        kind_index_positions[next[static_cast<size_t>(midi_events[i]->kind())]++] = i;
+    kind_index_stamp = current_stamp();
 }
 
 void cppmidi::midi_track::print(std::ostream& os, const std::string& indent) const {
@@ -752,20 +944,254 @@ void cppmidi::midi_track::print(std::ostream& os, const std::string& indent) con
     }
 }
 
-void cppmidi::midi_track::sort_events() {
-    auto cmp = [](
-            const std::unique_ptr<cppmidi::midi_event>& a,
-            const std::unique_ptr<cppmidi::midi_event>& b)
-    {
+cppmidi::event_order cppmidi::event_order::meta_first() {
+    event_order order;
+    order[event_kind::SysEx] = 1;
+    order[event_kind::Escape] = 1;
+    order[event_kind::NoteOff] = 2;
+    order[event_kind::NoteAftertouch] = 3;
+    order[event_kind::Controller] = 3;
+    order[event_kind::Program] = 3;
+    order[event_kind::ChannelAftertouch] = 3;
+    order[event_kind::PitchBend] = 3;
+    order[event_kind::NoteOn] = 4;
+    order[event_kind::EndOfTrack] = 5;
+    return order;
+}
+
+namespace {
+    struct sort_entry {
+        // ticks << 8 | rank
+        uint64_t key;
+        size_t index;
+    };
+
+    // LSD radix sort on the 40 bit keys, 8 bits per pass. Passes in which
+    // all keys have the same digit (e.g. the high tick bytes of short tracks
+    // or the rank if no order is given) are skipped.
+    void radix_sort(std::vector<sort_entry>& entries) {
+        std::vector<sort_entry> buffer(entries.size());
+        for (unsigned int shift = 0; shift < 40; shift += 8) {
+            size_t counts[256] = {};
+            for (const sort_entry& e : entries)
+                counts[(e.key >> shift) & 0xFF]++;
+            if (counts[(entries[0].key >> shift) & 0xFF] == entries.size())
+                continue;
+            size_t offset = 0;
+            for (size_t& count : counts) {
+                size_t c = count;
+                count = offset;
+                offset += c;
+            }
+            for (const sort_entry& e : entries)
+                buffer[counts[(e.key >> shift) & 0xFF]++] = e;
+            entries.swap(buffer);
+        }
+    }
+
+    // Merges adjacent sorted runs pairwise until a single one is left.
+    void merge_runs(std::vector<sort_entry>& entries, std::vector<size_t>& run_starts) {
+        auto cmp = [](const sort_entry& a, const sort_entry& b) { return a.key < b.key; };
+        run_starts.push_back(entries.size());
+        while (run_starts.size() > 2) {
+            std::vector<size_t> merged;
+            size_t i = 0;
+            for (; i + 2 < run_starts.size(); i += 2) {
+                std::inplace_merge(entries.begin() + static_cast<ptrdiff_t>(run_starts[i]),
+                        entries.begin() + static_cast<ptrdiff_t>(run_starts[i + 1]),
+                        entries.begin() + static_cast<ptrdiff_t>(run_starts[i + 2]), cmp);
+                merged.push_back(run_starts[i]);
+            }
+            for (; i < run_starts.size(); i++)
+                merged.push_back(run_starts[i]);
+            run_starts.swap(merged);
+        }
+    }
+}
+
+void cppmidi::midi_track::sort_events(const event_order& order) {
+    // radix sort does a constant 2 * 5 passes, below that comparisons are cheaper
+    const size_t min_radix_size = 4096;
+    // merging runs takes O(n log runs)
+    const size_t max_merge_runs = 64;
+
+    std::vector<sort_entry> entries(midi_events.size());
+    std::vector<size_t> run_starts{0};
+    for (size_t i = 0; i < midi_events.size(); i++) {
+        const midi_event& ev = *midi_events[i];
+        entries[i].key = static_cast<uint64_t>(ev.ticks) << 8 | order[ev.kind()];
+        entries[i].index = i;
+        if (i > 0 && entries[i].key < entries[i - 1].key)
+            run_starts.push_back(i);
+    }
+    // already sorted, keep the caches
+    if (run_starts.size() == 1)
+        return;
+
+    touch();
+    if (run_starts.size() <= max_merge_runs) {
+        merge_runs(entries, run_starts);
+    } else if (entries.size() >= min_radix_size) {
+        radix_sort(entries);
+    } else {
+        std::stable_sort(entries.begin(), entries.end(),
+                [](const sort_entry& a, const sort_entry& b) { return a.key < b.key; });
+    }
+
+    std::vector<std::unique_ptr<midi_event>> sorted(midi_events.size());
+    for (size_t i = 0; i < entries.size(); i++)
+        sorted[i] = std::move(midi_events[entries[i].index]);
+    midi_events.swap(sorted);
+}
+
+void cppmidi::midi_file::sort_track_events(const event_order& order) {
+    size_t num_events = 0;
+    for (const midi_track& tr : midi_tracks)
+        num_events += tr.midi_events.size();
+    parallel_for(midi_tracks.size(), num_events, [&](size_t i) {
+        midi_tracks[i].sort_events(order);
+    });
+}
+
+void cppmidi::track_builder::add(std::unique_ptr<midi_event> ev) {
+    if (events.empty() || ev->ticks >= events.back()->ticks) {
+        events.push_back(std::move(ev));
+        return;
+    }
+    pending.push_back(std::move(ev));
+    if (pending.size() >= max_pending)
+        flush();
+}
+
+void cppmidi::track_builder::flush() {
+    if (pending.empty())
+        return;
+    auto cmp = [](const std::unique_ptr<midi_event>& a, const std::unique_ptr<midi_event>& b) {
         return a->ticks < b->ticks;
     };
-    std::stable_sort(midi_events.begin(), midi_events.end(), cmp);
+    std::stable_sort(pending.begin(), pending.end(), cmp);
+
+    // pending events go after events with equal ticks, which were added earlier
+    auto tail = std::upper_bound(events.begin(), events.end(), pending.front(), cmp);
+    std::vector<std::unique_ptr<midi_event>> merged;
+    merged.reserve(static_cast<size_t>(events.end() - tail) + pending.size());
+    std::merge(std::make_move_iterator(tail), std::make_move_iterator(events.end()),
+            std::make_move_iterator(pending.begin()), std::make_move_iterator(pending.end()),
+            std::back_inserter(merged), cmp);
+    events.erase(tail, events.end());
+    events.insert(events.end(), std::make_move_iterator(merged.begin()),
+            std::make_move_iterator(merged.end()));
+    pending.clear();
+}
+
+cppmidi::midi_track cppmidi::track_builder::finalize() {
+    flush();
+    midi_track mtrk;
+    mtrk.midi_events = std::move(events);
+    events.clear();
+    return mtrk;
+}
+
+cppmidi::midi_merger& cppmidi::midi_merger::add(const midi_file& mf, uint32_t offset,
+        std::vector<size_t> track_map) {
+    midi_file copy;
+    copy.time_division = mf.time_division;
+    copy.midi_tracks.resize(mf.midi_tracks.size());
+    for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++) {
+        auto& events = copy.midi_tracks[trk].midi_events;
+        events.reserve(mf.midi_tracks[trk].midi_events.size());
+        for (const auto& ev : mf.midi_tracks[trk].midi_events)
+            events.push_back(ev->clone());
+    }
+    return add(std::move(copy), offset, std::move(track_map));
+}
+
+cppmidi::midi_merger& cppmidi::midi_merger::add(midi_file&& mf, uint32_t offset,
+        std::vector<size_t> track_map) {
+    if (!track_map.empty() && track_map.size() != mf.midi_tracks.size())
+        throw xcept("Invalid track map: %zu entries for %zu tracks",
+                track_map.size(), mf.midi_tracks.size());
+    if (mf.time_division != time_division) {
+        if ((mf.time_division & 0x8000) || (time_division & 0x8000))
+            throw xcept("Cannot merge files with frames/second time division");
+        mf.convert_time_division(time_division);
+    }
+    if (offset != 0)
+        mf.shift_ticks(offset);
+
+    // only touch the merger once nothing can throw anymore
+    if (track_map.empty()) {
+        for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++)
+            track_map.push_back(num_tracks + trk);
+    }
+    inputs.reserve(inputs.size() + 1);
+    for (size_t out : track_map)
+        num_tracks = std::max(num_tracks, out + 1);
+    inputs.push_back(input{std::move(mf), std::move(track_map)});
+    return *this;
 }
 
-void cppmidi::midi_file::sort_track_events() {
-    for (cppmidi::midi_track& tr : midi_tracks) {
-        tr.sort_events();
+cppmidi::midi_file cppmidi::midi_merger::finish() {
+    // source tracks of each output track, in the order they were added
+    std::vector<std::vector<midi_track *>> sources(num_tracks);
+    size_t num_events = 0;
+    for (input& in : inputs) {
+        for (size_t trk = 0; trk < in.file.midi_tracks.size(); trk++) {
+            sources[in.track_map[trk]].push_back(&in.file.midi_tracks[trk]);
+            num_events += in.file.midi_tracks[trk].midi_events.size();
+        }
     }
+
+    midi_file result;
+    result.time_division = time_division;
+    result.midi_tracks.resize(num_tracks);
+    parallel_for(num_tracks, num_events, [&](size_t out) {
+        struct cursor {
+            uint32_t ticks;
+            size_t source;
+            size_t index;
+            // heap order: the smallest (ticks, source) is at the front
+            bool operator<(const cursor& rhs) const {
+                if (ticks != rhs.ticks)
+                    return ticks > rhs.ticks;
+                return source > rhs.source;
+            }
+        };
+
+        std::vector<cursor> heap;
+        size_t total = 0;
+        uint32_t end_ticks = 0;
+        for (size_t src = 0; src < sources[out].size(); src++) {
+            midi_track& mtrk = *sources[out][src];
+            mtrk.sort_events();
+            total += mtrk.midi_events.size();
+            if (!mtrk.midi_events.empty()) {
+                heap.push_back(cursor{mtrk.midi_events[0]->ticks, src, 0});
+                end_ticks = std::max(end_ticks, mtrk.midi_events.back()->ticks);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end());
+
+        auto& dst = result.midi_tracks[out].midi_events;
+        dst.reserve(total + 1);
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end());
+            cursor cur = heap.back();
+            heap.pop_back();
+            auto& events = sources[out][cur.source]->midi_events;
+            if (events[cur.index]->kind() != event_kind::EndOfTrack)
+                dst.push_back(std::move(events[cur.index]));
+            if (++cur.index < events.size()) {
+                heap.push_back(cursor{events[cur.index]->ticks, cur.source, cur.index});
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+        dst.push_back(std::make_unique<endoftrack_meta_midi_event>(end_ticks));
+    });
+
+    inputs.clear();
+    num_tracks = 0;
+    return result;
 }
 
 void cppmidi::midi_file::convert_time_division(uint16_t time_division) {
@@ -776,16 +1202,7 @@ void cppmidi::midi_file::convert_time_division(uint16_t time_division) {
     if (time_division == this->time_division)
         return;
 
-    for (midi_track& trk : midi_tracks) {
-        for (auto& ev : trk.midi_events) {
-            uint64_t ticks = ev->ticks;
-            ticks *= time_division;
-            ticks /= this->time_division;
-            if (ticks >= 0x100000000)
-                throw xcept("Cannot convert time division: int32 tick overflow");
-            ev->ticks = static_cast<uint32_t>(ticks);
-        }
-    }
+    rescale_ticks(time_division, this->time_division);
     this->time_division = time_division;
 }
 
@@ -805,6 +1222,355 @@ void cppmidi::midi_file::print(std::ostream& os, const std::string& indent) cons
 
 //=============================================================================
 
+namespace {
+    const size_t tick_batch_size = 1024;
+
+    // Returns the transformed ticks of all events of a track. The kernel
+    // produces 64 bit results, so it can be inlined into a branch free loop
+    // and overflow is checked once per batch.
+    template<typename K>
+    std::vector<uint32_t> transform_ticks(const cppmidi::midi_track& mtrk, const K& kernel) {
+        const auto& events = mtrk.midi_events;
+        std::vector<uint32_t> ticks(events.size());
+        for (size_t i = 0; i < events.size(); i++)
+            ticks[i] = events[i]->ticks;
+
+        uint64_t result[tick_batch_size];
+        for (size_t batch = 0; batch < ticks.size(); batch += tick_batch_size) {
+            size_t count = std::min(tick_batch_size, ticks.size() - batch);
+            const uint32_t *in = ticks.data() + batch;
+            uint64_t high = 0;
+            for (size_t i = 0; i < count; i++) {
+                result[i] = kernel(in[i]);
+                high |= result[i];
+            }
+            if (high >> 32)
+                throw cppmidi::xcept("Cannot transform ticks: int32 tick overflow");
+            for (size_t i = 0; i < count; i++)
+                ticks[batch + i] = static_cast<uint32_t>(result[i]);
+        }
+        return ticks;
+    }
+
+    void store_ticks(cppmidi::midi_track& mtrk, const std::vector<uint32_t>& ticks) {
+        // events stay where they are, the kind index remains valid
+        mtrk.touch_contents();
+        for (size_t i = 0; i < ticks.size(); i++)
+            mtrk.midi_events[i]->ticks = ticks[i];
+    }
+
+    // All tracks are transformed before any is modified, so an overflow
+    // leaves the whole file untouched.
+    template<typename K>
+    void transform_file_ticks(cppmidi::midi_file& mf, const K& kernel) {
+        auto& tracks = mf.midi_tracks;
+        size_t num_events = 0;
+        for (const cppmidi::midi_track& mtrk : tracks)
+            num_events += mtrk.midi_events.size();
+
+        std::vector<std::vector<uint32_t>> ticks(tracks.size());
+        parallel_for(tracks.size(), num_events, [&](size_t i) {
+            ticks[i] = transform_ticks(tracks[i], kernel);
+        });
+        parallel_for(tracks.size(), num_events, [&](size_t i) {
+            store_ticks(tracks[i], ticks[i]);
+        });
+    }
+
+    struct rescale_kernel {
+        rescale_kernel(uint32_t num, uint32_t den, cppmidi::tick_rounding rounding)
+            : num(num), den(den) {
+            if (den == 0)
+                throw cppmidi::xcept("Cannot rescale ticks: denominator is zero");
+            switch (rounding) {
+            case cppmidi::tick_rounding::Down: bias = 0; break;
+            case cppmidi::tick_rounding::Nearest: bias = den / 2; break;
+            case cppmidi::tick_rounding::Up: bias = den - 1; break;
+            }
+        }
+        // cannot overflow: (2^32 - 1)^2 + 2^32 - 1 < 2^64
+        uint64_t operator()(uint32_t ticks) const {
+            return (ticks * num + bias) / den;
+        }
+        uint64_t num, den, bias;
+    };
+
+    struct shift_kernel {
+        explicit shift_kernel(int64_t offset)
+            : offset(std::clamp<int64_t>(offset, -0x100000000LL, 0x100000000LL)) {}
+        uint64_t operator()(uint32_t ticks) const {
+            int64_t result = static_cast<int64_t>(ticks) + offset;
+            return static_cast<uint64_t>(std::max<int64_t>(result, 0));
+        }
+        int64_t offset;
+    };
+
+    struct quantize_kernel {
+        quantize_kernel(uint32_t grid, double strength, double swing) : grid(grid) {
+            if (grid == 0)
+                throw cppmidi::xcept("Cannot quantize ticks: grid is zero");
+            if (!(strength >= 0.0 && strength <= 1.0))
+                throw cppmidi::xcept("Cannot quantize ticks: strength must be within 0..1");
+            if (!(swing >= 0.0 && swing < 1.0))
+                throw cppmidi::xcept("Cannot quantize ticks: swing must be within 0..<1");
+            // 16.16 fixed point, so the kernel doesn't need floating point
+            strength_q16 = static_cast<int64_t>(std::llround(strength * 65536.0));
+            swung = grid + static_cast<uint64_t>(std::llround(swing * grid));
+        }
+        uint64_t operator()(uint32_t ticks) const {
+            // grid lines repeat every two grid steps: at 0 and at the swung one
+            uint64_t pos = ticks % (2 * grid);
+            uint64_t base = ticks - pos;
+            uint64_t target = base;
+            if (2 * pos >= swung)
+                target = 2 * pos < swung + 2 * grid ? base + swung : base + 2 * grid;
+            int64_t distance = static_cast<int64_t>(target) - static_cast<int64_t>(ticks);
+            int64_t move = (distance * strength_q16 + (distance < 0 ? -0x8000 : 0x8000)) / 0x10000;
+            return static_cast<uint64_t>(static_cast<int64_t>(ticks) + move);
+        }
+        uint64_t grid;
+        uint64_t swung;
+        int64_t strength_q16;
+    };
+}
+
+void cppmidi::midi_track::rescale_ticks(uint32_t num, uint32_t den, tick_rounding rounding) {
+    store_ticks(*this, transform_ticks(*this, rescale_kernel(num, den, rounding)));
+}
+
+void cppmidi::midi_track::shift_ticks(int64_t offset) {
+    store_ticks(*this, transform_ticks(*this, shift_kernel(offset)));
+}
+
+void cppmidi::midi_track::quantize_ticks(uint32_t grid, double strength, double swing) {
+    store_ticks(*this, transform_ticks(*this, quantize_kernel(grid, strength, swing)));
+}
+
+void cppmidi::midi_file::rescale_ticks(uint32_t num, uint32_t den, tick_rounding rounding) {
+    transform_file_ticks(*this, rescale_kernel(num, den, rounding));
+}
+
+void cppmidi::midi_file::shift_ticks(int64_t offset) {
+    transform_file_ticks(*this, shift_kernel(offset));
+}
+
+void cppmidi::midi_file::quantize_ticks(uint32_t grid, double strength, double swing) {
+    transform_file_ticks(*this, quantize_kernel(grid, strength, swing));
+}
+
+//=============================================================================
+
+cppmidi::event_pipeline& cppmidi::event_pipeline::insert(std::function<void(const midi_event&,
+            std::vector<std::unique_ptr<midi_event>>&)> f, std::string name) {
+    add_stage(stage_type::Insert, std::move(name), nullptr);
+    stages.back().insert = std::move(f);
+    return *this;
+}
+
+void cppmidi::event_pipeline::add_stage(stage_type type, std::string name,
+        std::function<bool(midi_event&)> apply) {
+    stages.push_back(stage{type, std::move(apply), nullptr});
+    stats.emplace_back();
+    stats.back().name = std::move(name);
+}
+
+void cppmidi::event_pipeline::reset_stats() {
+    for (stage_stats& st : stats)
+        st.seen = st.dropped = st.modified = st.inserted = 0;
+}
+
+void cppmidi::event_pipeline::process(event_ref ref, size_t first_stage, track_run& tr) const {
+    for (size_t i = first_stage; i < stages.size(); i++) {
+        midi_event& ev = ref.inserted ? *tr.inserted[ref.index] : *tr.mtrk.midi_events[ref.index];
+        const stage& st = stages[i];
+        stage_stats& counters = tr.stats[i];
+        counters.seen++;
+        switch (st.type) {
+        case stage_type::Filter:
+            if (st.apply(ev)) {
+                counters.dropped++;
+                return;
+            }
+            break;
+        case stage_type::Map:
+            if (st.apply(ev))
+                counters.modified++;
+            break;
+        case stage_type::Insert:
+            {
+                std::vector<std::unique_ptr<midi_event>> inserted;
+                st.insert(ev, inserted);
+                counters.inserted += inserted.size();
+                process(ref, i + 1, tr);
+                for (auto& iev : inserted) {
+                    if (!iev)
+                        continue;
+                    tr.inserted.push_back(std::move(iev));
+                    process(event_ref{true, tr.inserted.size() - 1}, i + 1, tr);
+                }
+            }
+            return;
+        }
+    }
+    tr.out.push_back(ref);
+}
+
+std::vector<cppmidi::event_pipeline::stage_stats> cppmidi::event_pipeline::run_track(
+        midi_track& mtrk) const {
+    // map stages modify events in place
+    mtrk.touch_contents();
+    track_run tr{mtrk, {}, {}, std::vector<stage_stats>(stages.size())};
+    tr.out.reserve(mtrk.midi_events.size());
+    for (size_t i = 0; i < mtrk.midi_events.size(); i++)
+        process(event_ref{false, i}, 0, tr);
+
+    // all stages passed, the events can be moved now
+    std::vector<std::unique_ptr<midi_event>> result;
+    result.reserve(tr.out.size());
+    for (event_ref ref : tr.out)
+        result.push_back(std::move(ref.inserted ? tr.inserted[ref.index] : mtrk.midi_events[ref.index]));
+    mtrk.midi_events.swap(result);
+    mtrk.touch();
+
+    for (size_t i = 1; i < mtrk.midi_events.size(); i++) {
+        if (mtrk.midi_events[i]->ticks < mtrk.midi_events[i - 1]->ticks) {
+            mtrk.sort_events();
+            break;
+        }
+    }
+    return tr.stats;
+}
+
+void cppmidi::event_pipeline::add_stats(const std::vector<stage_stats>& track_stats) {
+    for (size_t i = 0; i < stats.size(); i++) {
+        stats[i].seen += track_stats[i].seen;
+        stats[i].dropped += track_stats[i].dropped;
+        stats[i].modified += track_stats[i].modified;
+        stats[i].inserted += track_stats[i].inserted;
+    }
+}
+
+void cppmidi::event_pipeline::run(midi_track& mtrk) {
+    add_stats(run_track(mtrk));
+}
+
+void cppmidi::event_pipeline::run(midi_file& mf) {
+    size_t num_events = 0;
+    for (const midi_track& mtrk : mf.midi_tracks)
+        num_events += mtrk.midi_events.size();
+    std::vector<std::vector<stage_stats>> track_stats(mf.midi_tracks.size());
+    if (parallel) {
+        parallel_for(mf.midi_tracks.size(), num_events, [&](size_t trk) {
+            track_stats[trk] = run_track(mf.midi_tracks[trk]);
+        });
+    } else {
+        for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++)
+            track_stats[trk] = run_track(mf.midi_tracks[trk]);
+    }
+
+    // summed in track order, independent of the scheduling
+    for (const auto& ts : track_stats)
+        add_stats(ts);
+
+    if (drop_empty) {
+        mf.midi_tracks.erase(std::remove_if(mf.midi_tracks.begin(), mf.midi_tracks.end(),
+                    [](const midi_track& mtrk) {
+                        return std::all_of(mtrk.midi_events.begin(), mtrk.midi_events.end(),
+                                [](const std::unique_ptr<midi_event>& ev) {
+                                    return ev->kind() == event_kind::EndOfTrack;
+                                });
+                    }), mf.midi_tracks.end());
+    }
+}
+
+//=============================================================================
+
+// Longest processing time first: the tracks with the most events go to the
+// worker with the least events so far. Ties go to the lower index, so the
+// distribution only depends on the track sizes.
+static std::vector<std::vector<size_t>> distribute_tracks(const cppmidi::midi_file& mf,
+        size_t num_workers) {
+    std::vector<size_t> order(mf.midi_tracks.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return mf.midi_tracks[a].midi_events.size() > mf.midi_tracks[b].midi_events.size();
+    });
+
+    std::vector<std::vector<size_t>> assignment(num_workers);
+    std::vector<size_t> load(num_workers, 0);
+    for (size_t trk : order) {
+        size_t worker = static_cast<size_t>(
+                std::min_element(load.begin(), load.end()) - load.begin());
+        assignment[worker].push_back(trk);
+        load[worker] += mf.midi_tracks[trk].midi_events.size();
+    }
+    // within a worker, visit tracks in file order
+    for (auto& tracks : assignment)
+        std::sort(tracks.begin(), tracks.end());
+    return assignment;
+}
+
+static size_t visit_workers(const cppmidi::midi_file& mf, size_t num_workers) {
+    if (num_workers == 0)
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    return std::max<size_t>(1, std::min(num_workers, mf.midi_tracks.size()));
+}
+
+// visitors[trk] visits track trk, on the worker the track is assigned to
+static void visit_distributed(cppmidi::midi_file& mf, size_t num_workers,
+        const std::vector<cppmidi::visitor *>& visitors) {
+    std::vector<std::vector<size_t>> assignment = distribute_tracks(mf, num_workers);
+
+    std::exception_ptr error;
+    std::mutex error_mtx;
+    auto work = [&](size_t worker) {
+        try {
+            for (size_t trk : assignment[worker])
+                visitors[trk]->visit(mf.midi_tracks[trk]);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mtx);
+            if (!error)
+                error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t worker = 1; worker < num_workers; worker++)
+        threads.emplace_back(work, worker);
+    work(0);
+    for (std::thread& t : threads)
+        t.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void cppmidi::parallel_visit(midi_file& mf,
+        const std::function<std::unique_ptr<visitor>(size_t trk)>& factory,
+        const std::function<void(visitor&)>& reduce, size_t num_workers) {
+    std::vector<std::unique_ptr<visitor>> owned;
+    std::vector<visitor *> visitors;
+    for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++) {
+        owned.push_back(factory(trk));
+        if (!owned.back())
+            throw xcept("Visitor factory returned no visitor for track %zu", trk);
+        visitors.push_back(owned.back().get());
+    }
+
+    visit_distributed(mf, visit_workers(mf, num_workers), visitors);
+
+    if (reduce) {
+        for (auto& v : owned)
+            reduce(*v);
+    }
+}
+
+void cppmidi::parallel_visit(midi_file& mf, visitor& v, size_t num_workers) {
+    visit_distributed(mf, visit_workers(mf, num_workers),
+            std::vector<visitor *>(mf.midi_tracks.size(), &v));
+}
+
+//=============================================================================
+
 std::vector<uint8_t> cppmidi::dummy_midi_event::event_data() const {
     throw xcept("dummy events cannot be serialized");
 }
@@ -1232,6 +1998,2333 @@ void cppmidi::escape_midi_event::print(std::ostream& os, const std::string& inde
 
 //=============================================================================
 
+cppmidi::sysex_reassembler::sysex_reassembler(const midi_track& mtrk) {
+    // pointers into the buffer are set once it doesn't grow anymore
+    std::vector<size_t> buffer_offsets;
+    const sysex_midi_event *single = nullptr;
+    bool ongoing = false;
+
+    for (size_t i = 0; i < mtrk.midi_events.size(); i++) {
+        const midi_event& ev = *mtrk.midi_events[i];
+        if (ev.kind() != event_kind::SysEx)
+            continue;
+        const auto& sev = static_cast<const sysex_midi_event&>(ev);
+        const std::vector<uint8_t>& data = sev.get_data();
+        bool last = !data.empty() && data.back() == 0xF7;
+
+        if (sev.get_first_chunk()) {
+            // an unterminated message before stays incomplete
+            messages.push_back(sysex_message{ev.ticks, i, i, data.data(), data.size(), last});
+            buffer_offsets.push_back(SIZE_MAX);
+            single = &sev;
+        } else if (ongoing) {
+            sysex_message& msg = messages.back();
+            if (single) {
+                // second packet, start the copy
+                buffer_offsets.back() = buffer.size();
+                buffer.insert(buffer.end(), single->get_data().begin(), single->get_data().end());
+                single = nullptr;
+            }
+            buffer.insert(buffer.end(), data.begin(), data.end());
+            msg.last_index = i;
+            msg.size += data.size();
+            msg.complete = last;
+        } else {
+            continue;
+        }
+        ongoing = !last;
+    }
+
+    for (size_t m = 0; m < messages.size(); m++) {
+        if (buffer_offsets[m] != SIZE_MAX)
+            messages[m].data = buffer.data() + buffer_offsets[m];
+    }
+}
+
+std::vector<std::unique_ptr<cppmidi::midi_event>> cppmidi::split_sysex(uint32_t ticks,
+        const uint8_t *data, size_t size, size_t max_packet_size, uint32_t packet_interval) {
+    if (max_packet_size == 0)
+        throw xcept("Invalid SysEx packet size: 0");
+    std::vector<uint8_t> payload(data, data + size);
+    if (payload.empty() || payload.back() != 0xF7)
+        payload.push_back(0xF7);
+
+    std::vector<std::unique_ptr<midi_event>> packets;
+    packets.reserve((payload.size() + max_packet_size - 1) / max_packet_size);
+    for (size_t pos = 0; pos < payload.size(); pos += max_packet_size) {
+        size_t len = std::min(max_packet_size, payload.size() - pos);
+        packets.emplace_back(std::make_unique<sysex_midi_event>(ticks,
+                    std::vector<uint8_t>(payload.begin() + static_cast<ptrdiff_t>(pos),
+                        payload.begin() + static_cast<ptrdiff_t>(pos + len)), pos == 0));
+        ticks += packet_interval;
+    }
+    return packets;
+}
+
+//=============================================================================
+
+cppmidi::merged_event_stream::merged_event_stream(const midi_file& mf, uint32_t start_ticks)
+    : mf(mf) {
+    heap.reserve(mf.midi_tracks.size());
+    for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++) {
+        size_t index = (start_ticks == 0) ? 0 : mf.midi_tracks[trk].lower_bound(start_ticks);
+        push(trk, index);
+    }
+}
+
+void cppmidi::merged_event_stream::push(size_t track, size_t index) {
+    const auto& events = mf.midi_tracks[track].midi_events;
+    if (index >= events.size())
+        return;
+    heap.push_back(cursor{events[index]->ticks, track, index});
+    std::push_heap(heap.begin(), heap.end());
+}
+
+void cppmidi::merged_event_stream::pop() {
+    std::pop_heap(heap.begin(), heap.end());
+    cursor cur = heap.back();
+    heap.pop_back();
+    push(cur.track, cur.index + 1);
+}
+
+//=============================================================================
+
+cppmidi::tempo_map::tempo_map(const midi_file& mf) : time_division(mf.time_division) {
+    if (time_division == 0 || (time_division & 0x8000))
+        throw xcept("Tempo map requires a ticks per beat time division");
+
+    struct tempo_change {
+        uint32_t ticks;
+        uint32_t us_per_beat;
+    };
+    std::vector<tempo_change> changes;
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        for (const auto& ev : mtrk.midi_events) {
+            if (ev->kind() == event_kind::Tempo) {
+                changes.push_back(tempo_change{ev->ticks,
+                        static_cast<const tempo_meta_midi_event&>(*ev).get_us_per_beat()});
+            }
+        }
+    }
+    // on equal ticks the last change in track order wins
+    std::stable_sort(changes.begin(), changes.end(),
+            [](const tempo_change& a, const tempo_change& b) { return a.ticks < b.ticks; });
+
+    segments.push_back(segment{0, 500000, 0});
+    for (const tempo_change& tc : changes) {
+        segment& last = segments.back();
+        if (tc.ticks == last.ticks) {
+            last.us_per_beat = tc.us_per_beat;
+            continue;
+        }
+        uint64_t scaled_us = last.scaled_us +
+            static_cast<uint64_t>(tc.ticks - last.ticks) * last.us_per_beat;
+        segments.push_back(segment{tc.ticks, tc.us_per_beat, scaled_us});
+    }
+}
+
+size_t cppmidi::tempo_map::find_segment(uint32_t ticks) const {
+    auto it = std::upper_bound(segments.begin(), segments.end(), ticks,
+            [](uint32_t t, const segment& seg) { return t < seg.ticks; });
+    return static_cast<size_t>(it - segments.begin()) - 1;
+}
+
+size_t cppmidi::tempo_map::find_segment_scaled(uint64_t scaled_us) const {
+    auto it = std::upper_bound(segments.begin(), segments.end(), scaled_us,
+            [](uint64_t s, const segment& seg) { return s < seg.scaled_us; });
+    return static_cast<size_t>(it - segments.begin()) - 1;
+}
+
+uint64_t cppmidi::tempo_map::ticks_to_us(uint32_t ticks) const {
+    const segment& seg = segments[find_segment(ticks)];
+    return (seg.scaled_us + static_cast<uint64_t>(ticks - seg.ticks) * seg.us_per_beat) /
+        time_division;
+}
+
+static uint32_t segment_us_to_ticks(const cppmidi::tempo_map::segment& seg, uint64_t scaled_us) {
+    if (seg.us_per_beat == 0)
+        return seg.ticks;
+    uint64_t ticks = seg.ticks + (scaled_us - seg.scaled_us) / seg.us_per_beat;
+    return static_cast<uint32_t>(std::min<uint64_t>(ticks, UINT32_MAX));
+}
+
+// Returns the largest scaled time which ticks_to_us() rounds down to us.
+// Scaled times of valid ticks fit into 56 bits, so saturating is fine.
+static uint64_t scale_us(uint64_t us, uint16_t time_division) {
+    if (us >= UINT64_MAX / time_division)
+        return UINT64_MAX;
+    return us * time_division + (time_division - 1u);
+}
+
+uint32_t cppmidi::tempo_map::us_to_ticks(uint64_t us) const {
+    uint64_t scaled_us = scale_us(us, time_division);
+    return segment_us_to_ticks(segments[find_segment_scaled(scaled_us)], scaled_us);
+}
+
+void cppmidi::tempo_map::ticks_to_us(const uint32_t *ticks, uint64_t *us, size_t count) const {
+    size_t seg_idx = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t t = ticks[i];
+        // stay in the current segment or advance to the next one before searching
+        if (t < segments[seg_idx].ticks) {
+            seg_idx = find_segment(t);
+        } else if (seg_idx + 1 < segments.size() && t >= segments[seg_idx + 1].ticks) {
+            seg_idx++;
+            if (seg_idx + 1 < segments.size() && t >= segments[seg_idx + 1].ticks)
+                seg_idx = find_segment(t);
+        }
+        const segment& seg = segments[seg_idx];
+        us[i] = (seg.scaled_us + static_cast<uint64_t>(t - seg.ticks) * seg.us_per_beat) /
+            time_division;
+    }
+}
+
+void cppmidi::tempo_map::us_to_ticks(const uint64_t *us, uint32_t *ticks, size_t count) const {
+    size_t seg_idx = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t scaled_us = scale_us(us[i], time_division);
+        if (scaled_us < segments[seg_idx].scaled_us) {
+            seg_idx = find_segment_scaled(scaled_us);
+        } else if (seg_idx + 1 < segments.size() && scaled_us >= segments[seg_idx + 1].scaled_us) {
+            seg_idx++;
+            if (seg_idx + 1 < segments.size() && scaled_us >= segments[seg_idx + 1].scaled_us)
+                seg_idx = find_segment_scaled(scaled_us);
+        }
+        ticks[i] = segment_us_to_ticks(segments[seg_idx], scaled_us);
+    }
+}
+
+//=============================================================================
+
+cppmidi::channel_state::channel_state()
+    : program(0), program_set(false), pitch_bend(0), bend_range_semitones(2),
+    bend_range_cents(0), bend_range_set(false), nrpn_selected(false) {
+    controllers.fill(0);
+    controllers[MIDI_CC_MSB_VOLUME] = 100;
+    controllers[MIDI_CC_MSB_PAN] = 64;
+    controllers[MIDI_CC_MSB_EXPRESSION] = 127;
+    controllers[MIDI_CC_LSB_NRPN] = 127;
+    controllers[MIDI_CC_MSB_NRPN] = 127;
+    controllers[MIDI_CC_LSB_RPN] = 127;
+    controllers[MIDI_CC_MSB_RPN] = 127;
+}
+
+void cppmidi::channel_state::set_controller(uint8_t controller, uint8_t value) {
+    switch (controller) {
+    case MIDI_CC_MSB_DATA_ENTRY:
+    case MIDI_CC_LSB_DATA_ENTRY:
+        // only the pitch bend range is tracked, RPN 0
+        if (controllers[MIDI_CC_MSB_RPN] == 0 && controllers[MIDI_CC_LSB_RPN] == 0) {
+            if (controller == MIDI_CC_MSB_DATA_ENTRY)
+                bend_range_semitones = value;
+            else
+                bend_range_cents = value;
+            bend_range_set = true;
+        }
+        return;
+    case MIDI_CC_LSB_NRPN:
+    case MIDI_CC_MSB_NRPN:
+        // selecting an NRPN deselects the RPN and vice versa
+        controllers[MIDI_CC_LSB_RPN] = controllers[MIDI_CC_MSB_RPN] = 127;
+        nrpn_selected = true;
+        break;
+    case MIDI_CC_LSB_RPN:
+    case MIDI_CC_MSB_RPN:
+        controllers[MIDI_CC_LSB_NRPN] = controllers[MIDI_CC_MSB_NRPN] = 127;
+        nrpn_selected = false;
+        break;
+    case MIDI_CC_ALL_CTRL_RESET:
+        // as recommended by RP-015
+        for (uint8_t cc : std::initializer_list<uint8_t>{MIDI_CC_MSB_MOD,
+                MIDI_CC_SUSTAIN_PEDAL, MIDI_CC_PORT_SWITCH, MIDI_CC_SOST_SWITCH,
+                MIDI_CC_SOFT_PEDAL}) {
+            controllers[cc] = 0;
+            controllers_set[cc] = false;
+        }
+        controllers[MIDI_CC_MSB_EXPRESSION] = 127;
+        controllers_set[MIDI_CC_MSB_EXPRESSION] = false;
+        for (uint8_t cc : std::initializer_list<uint8_t>{MIDI_CC_LSB_NRPN,
+                MIDI_CC_MSB_NRPN, MIDI_CC_LSB_RPN, MIDI_CC_MSB_RPN}) {
+            controllers[cc] = 127;
+            controllers_set[cc] = false;
+        }
+        nrpn_selected = false;
+        pitch_bend = 0;
+        return;
+    default:
+        // channel mode messages and data increment/decrement don't hold state
+        if (controller >= MIDI_CC_ALL_SOUND_OFF || controller == MIDI_CC_DATA_INC ||
+                controller == MIDI_CC_DATA_DEC)
+            return;
+        break;
+    }
+    controllers[controller] = value;
+    controllers_set[controller] = true;
+}
+
+void cppmidi::channel_state::set_program(uint8_t program) {
+    this->program = program;
+    program_set = true;
+}
+
+void cppmidi::channel_state::set_pitch_bend(int16_t pitch) {
+    pitch_bend = pitch;
+}
+
+void cppmidi::channel_state::append_events(midi_track& mtrk, uint32_t ticks,
+        uint8_t channel) const {
+    auto add_cc = [&](uint8_t cc, uint8_t value) {
+        mtrk.midi_events.emplace_back(
+                std::make_unique<controller_message_midi_event>(ticks, channel, cc, value));
+    };
+
+    // bank select only takes effect with the following program change
+    for (uint8_t cc : std::initializer_list<uint8_t>{MIDI_CC_MSB_BANK_SELECT,
+            MIDI_CC_LSB_BANK_SELECT}) {
+        if (controllers_set[cc])
+            add_cc(cc, controllers[cc]);
+    }
+    if (program_set)
+        mtrk.midi_events.emplace_back(
+                std::make_unique<program_message_midi_event>(ticks, channel, program));
+    for (uint8_t cc = 0; cc < 128; cc++) {
+        if (!controllers_set[cc] || cc == MIDI_CC_MSB_BANK_SELECT ||
+                cc == MIDI_CC_LSB_BANK_SELECT || (cc >= MIDI_CC_LSB_NRPN && cc <= MIDI_CC_MSB_RPN))
+            continue;
+        add_cc(cc, controllers[cc]);
+    }
+    if (bend_range_set) {
+        add_cc(MIDI_CC_MSB_RPN, 0);
+        add_cc(MIDI_CC_LSB_RPN, 0);
+        add_cc(MIDI_CC_MSB_DATA_ENTRY, bend_range_semitones);
+        add_cc(MIDI_CC_LSB_DATA_ENTRY, bend_range_cents);
+    }
+    // Restore the parameter selection last so later data entry goes to it.
+    // Only the type selected last is sent, selecting the other would undo it.
+    if (nrpn_selected) {
+        add_cc(MIDI_CC_MSB_NRPN, controllers[MIDI_CC_MSB_NRPN]);
+        add_cc(MIDI_CC_LSB_NRPN, controllers[MIDI_CC_LSB_NRPN]);
+    } else if (bend_range_set || controllers_set[MIDI_CC_MSB_RPN] ||
+            controllers_set[MIDI_CC_LSB_RPN]) {
+        add_cc(MIDI_CC_MSB_RPN, controllers[MIDI_CC_MSB_RPN]);
+        add_cc(MIDI_CC_LSB_RPN, controllers[MIDI_CC_LSB_RPN]);
+    }
+    if (pitch_bend != 0)
+        mtrk.midi_events.emplace_back(
+                std::make_unique<pitchbend_message_midi_event>(ticks, channel, pitch_bend));
+}
+
+//=============================================================================
+
+cppmidi::state_chaser::state_chaser(const midi_file& mf, size_t checkpoint_interval)
+    : checkpoint_interval(checkpoint_interval) {
+    if (checkpoint_interval == 0)
+        throw xcept("Checkpoint interval must not be zero");
+
+    for (const merged_event& m : merged_event_stream(mf)) {
+        const midi_event& ev = *m.event;
+        state_change change{ev.ticks, 0, ev.kind(), 0, 0, 0};
+        switch (ev.kind()) {
+        case event_kind::Controller:
+            {
+                const auto& cev = static_cast<const controller_message_midi_event&>(ev);
+                change.channel = cev.channel();
+                change.controller = cev.get_controller();
+                change.value = cev.get_value();
+            }
+            break;
+        case event_kind::Program:
+            {
+                const auto& pev = static_cast<const program_message_midi_event&>(ev);
+                change.channel = pev.channel();
+                change.value = pev.get_program();
+            }
+            break;
+        case event_kind::PitchBend:
+            {
+                const auto& pev = static_cast<const pitchbend_message_midi_event&>(ev);
+                change.channel = pev.channel();
+                change.pitch = pev.get_pitch();
+            }
+            break;
+        default:
+            continue;
+        }
+        changes.push_back(change);
+    }
+
+    std::array<channel_state, 16> state;
+    checkpoints.reserve(changes.size() / checkpoint_interval + 1);
+    for (size_t i = 0; i <= changes.size(); i++) {
+        if (i % checkpoint_interval == 0)
+            checkpoints.push_back(state);
+        if (i < changes.size())
+            apply(state[changes[i].channel], changes[i]);
+    }
+}
+
+std::array<cppmidi::channel_state, 16> cppmidi::state_chaser::state_at(uint32_t ticks) const {
+    size_t end;
+    size_t i = replay_start(ticks, end);
+    std::array<channel_state, 16> state = checkpoints[i / checkpoint_interval];
+    for (; i < end; i++)
+        apply(state[changes[i].channel], changes[i]);
+    return state;
+}
+
+cppmidi::channel_state cppmidi::state_chaser::state_at(uint32_t ticks, uint8_t channel) const {
+    if (channel >= 16)
+        throw xcept("Invalid channel: %d", channel);
+    size_t end;
+    size_t i = replay_start(ticks, end);
+    channel_state state = checkpoints[i / checkpoint_interval][channel];
+    for (; i < end; i++) {
+        if (changes[i].channel == channel)
+            apply(state, changes[i]);
+    }
+    return state;
+}
+
+size_t cppmidi::state_chaser::replay_start(uint32_t ticks, size_t& end) const {
+    end = static_cast<size_t>(std::lower_bound(changes.begin(), changes.end(), ticks,
+                [](const state_change& c, uint32_t t) { return c.ticks < t; }) - changes.begin());
+    return end / checkpoint_interval * checkpoint_interval;
+}
+
+void cppmidi::state_chaser::apply(channel_state& state, const state_change& change) {
+    switch (change.kind) {
+    case event_kind::Controller:
+        state.set_controller(change.controller, change.value);
+        break;
+    case event_kind::Program:
+        state.set_program(change.value);
+        break;
+    default:
+        state.set_pitch_bend(change.pitch);
+        break;
+    }
+}
+
+//=============================================================================
+
+namespace {
+    // everything slicing needs from the whole file
+    struct slice_context {
+        explicit slice_context(const cppmidi::midi_file& mf) : chaser(mf) {
+            using namespace cppmidi;
+            if (mf.time_division != 0 && !(mf.time_division & 0x8000)) {
+                tempo_map map(mf);
+                const auto& segments = map.get_segments();
+                if (segments.size() > 1 || segments[0].us_per_beat != 500000)
+                    tempo.emplace(std::move(map));
+            }
+
+            // the chased state of a channel goes to the first track using it
+            home_track.fill(0);
+            uint16_t found = 0;
+            for (size_t trk = 0; trk < mf.midi_tracks.size() && found != 0xFFFF; trk++) {
+                for (const auto& ev : mf.midi_tracks[trk].midi_events) {
+                    auto mev = dynamic_cast<const message_midi_event *>(ev.get());
+                    if (!mev || (found & (1 << mev->channel())))
+                        continue;
+                    found = static_cast<uint16_t>(found | (1 << mev->channel()));
+                    home_track[mev->channel()] = trk;
+                }
+            }
+        }
+
+        cppmidi::state_chaser chaser;
+        std::optional<cppmidi::tempo_map> tempo;
+        std::array<size_t, 16> home_track;
+    };
+
+    // take(event) returns either a copy or the moved event
+    template<typename File, typename Take>
+    cppmidi::midi_file slice_file(File& mf, const slice_context& ctx,
+            uint32_t tick_begin, uint32_t tick_end, Take take) {
+        using namespace cppmidi;
+        if (tick_begin >= tick_end)
+            throw xcept("Invalid slice: end must be after begin");
+        uint32_t length = tick_end - tick_begin;
+
+        midi_file result;
+        result.time_division = mf.time_division;
+        result.midi_tracks.resize(mf.midi_tracks.size());
+
+        if (tick_begin > 0 && !result.midi_tracks.empty()) {
+            if (ctx.tempo) {
+                result.midi_tracks[0].midi_events.emplace_back(std::make_unique<tempo_meta_midi_event>(
+                            0, ctx.tempo->us_per_beat_at(tick_begin - 1)));
+            }
+            std::array<channel_state, 16> state = ctx.chaser.state_at(tick_begin);
+            for (uint8_t ch = 0; ch < 16; ch++)
+                state[ch].append_events(result.midi_tracks[ctx.home_track[ch]], 0, ch);
+        }
+
+        for (size_t trk = 0; trk < mf.midi_tracks.size(); trk++) {
+            auto& src = mf.midi_tracks[trk].midi_events;
+            auto& dst = result.midi_tracks[trk].midi_events;
+            const midi_track& src_track = mf.midi_tracks[trk];
+            size_t begin = src_track.lower_bound(tick_begin);
+            size_t end = src_track.lower_bound(tick_end);
+
+            // note ons within the window, per channel and key
+            std::array<std::array<uint16_t, 128>, 16> sounding{};
+            for (size_t i = begin; i < end; i++) {
+                const midi_event& ev = *src[i];
+                if (ev.kind() == event_kind::EndOfTrack)
+                    continue;
+                if (ev.kind() == event_kind::NoteOn || ev.kind() == event_kind::NoteOff) {
+                    bool on = ev.kind() == event_kind::NoteOn &&
+                        static_cast<const noteon_message_midi_event&>(ev).get_velocity() != 0;
+                    uint8_t ch = static_cast<const message_midi_event&>(ev).channel();
+                    uint8_t key = ev.kind() == event_kind::NoteOn ?
+                        static_cast<const noteon_message_midi_event&>(ev).get_key() :
+                        static_cast<const noteoff_message_midi_event&>(ev).get_key();
+                    uint16_t& count = sounding[ch][key];
+                    if (on) {
+                        count++;
+                    } else if (count == 0) {
+                        // the note was started before the window
+                        continue;
+                    } else {
+                        count--;
+                    }
+                }
+                std::unique_ptr<midi_event> out = take(src[i]);
+                out->ticks -= tick_begin;
+                dst.push_back(std::move(out));
+            }
+
+            for (uint8_t ch = 0; ch < 16; ch++) {
+                for (uint8_t key = 0; key < 128; key++) {
+                    for (uint16_t n = 0; n < sounding[ch][key]; n++)
+                        dst.emplace_back(std::make_unique<noteoff_message_midi_event>(
+                                    length, ch, key, 0));
+                }
+            }
+            dst.emplace_back(std::make_unique<endoftrack_meta_midi_event>(length));
+        }
+        return result;
+    }
+}
+
+cppmidi::midi_file cppmidi::midi_file::slice(uint32_t tick_begin, uint32_t tick_end) const& {
+    return slice_file(*this, slice_context(*this), tick_begin, tick_end,
+            [](const std::unique_ptr<midi_event>& ev) { return ev->clone(); });
+}
+
+cppmidi::midi_file cppmidi::midi_file::slice(uint32_t tick_begin, uint32_t tick_end) && {
+    slice_context ctx(*this);
+    // the moved-from file keeps the events which weren't moved
+    auto drop_moved = [this]() {
+        for (midi_track& mtrk : midi_tracks) {
+            auto& events = mtrk.midi_events;
+            events.erase(std::remove(events.begin(), events.end(), nullptr), events.end());
+            mtrk.touch();
+        }
+    };
+    try {
+        midi_file result = slice_file(*this, ctx, tick_begin, tick_end,
+                [](std::unique_ptr<midi_event>& ev) { return std::move(ev); });
+        drop_moved();
+        return result;
+    } catch (...) {
+        drop_moved();
+        throw;
+    }
+}
+
+std::vector<cppmidi::midi_file> cppmidi::midi_file::slice(
+        const std::vector<std::pair<uint32_t, uint32_t>>& windows) const {
+    slice_context ctx(*this);
+    std::vector<midi_file> result;
+    result.reserve(windows.size());
+    for (const auto& window : windows) {
+        result.push_back(slice_file(*this, ctx, window.first, window.second,
+                    [](const std::unique_ptr<midi_event>& ev) { return ev->clone(); }));
+    }
+    return result;
+}
+
+//=============================================================================
+
+namespace {
+    // state the redundancy rules compare against, out of range values are unknown
+    struct redundancy_channel {
+        redundancy_channel() {
+            controllers.fill(-1);
+        }
+        std::array<int16_t, 128> controllers;
+        int16_t program = -1;
+        int32_t pitch_bend = INT32_MIN;
+        bool bank_changed = false;
+    };
+
+    struct redundancy_note {
+        uint16_t sounding = 0;
+        // note offs left over from removed duplicate note ons
+        uint16_t extra_offs = 0;
+        // the note on which started sounding
+        size_t track = 0;
+        size_t index = 0;
+        uint32_t ticks = 0;
+    };
+
+    bool controller_keeps_state(uint8_t controller) {
+        return controller != MIDI_CC_MSB_DATA_ENTRY && controller != MIDI_CC_LSB_DATA_ENTRY &&
+            controller != MIDI_CC_DATA_INC && controller != MIDI_CC_DATA_DEC &&
+            controller < MIDI_CC_ALL_SOUND_OFF;
+    }
+}
+
+cppmidi::redundancy_report cppmidi::midi_file::remove_redundant_events(
+        const redundancy_rules& rules) {
+    std::vector<std::vector<bool>> removed(midi_tracks.size());
+    for (size_t trk = 0; trk < midi_tracks.size(); trk++)
+        removed[trk].resize(midi_tracks[trk].midi_events.size());
+
+    std::array<redundancy_channel, 16> channels;
+    std::vector<redundancy_note> notes(16 * 128);
+    int64_t tempo = -1;
+
+    merged_event_stream stream(*this);
+    for (merged_event mev : stream) {
+        const midi_event& ev = *mev.event;
+        auto remove = [&]() { removed[mev.track][mev.index] = true; };
+        switch (ev.kind()) {
+        case event_kind::Controller:
+            {
+                const auto& cev = static_cast<const controller_message_midi_event&>(ev);
+                redundancy_channel& ch = channels[cev.channel()];
+                uint8_t cc = cev.get_controller();
+                if (cc == MIDI_CC_ALL_CTRL_RESET) {
+                    // conservatively forget everything the reset may affect
+                    ch = redundancy_channel();
+                } else if (controller_keeps_state(cc)) {
+                    if (rules.repeated_controllers && ch.controllers[cc] == cev.get_value()) {
+                        remove();
+                        break;
+                    }
+                    ch.controllers[cc] = cev.get_value();
+                    if (cc == MIDI_CC_MSB_BANK_SELECT || cc == MIDI_CC_LSB_BANK_SELECT)
+                        ch.bank_changed = true;
+                    // selecting an RPN deselects the NRPN and vice versa
+                    if (cc == MIDI_CC_LSB_RPN || cc == MIDI_CC_MSB_RPN)
+                        ch.controllers[MIDI_CC_LSB_NRPN] = ch.controllers[MIDI_CC_MSB_NRPN] = -1;
+                    if (cc == MIDI_CC_LSB_NRPN || cc == MIDI_CC_MSB_NRPN)
+                        ch.controllers[MIDI_CC_LSB_RPN] = ch.controllers[MIDI_CC_MSB_RPN] = -1;
+                }
+            }
+            break;
+        case event_kind::Program:
+            {
+                const auto& pev = static_cast<const program_message_midi_event&>(ev);
+                redundancy_channel& ch = channels[pev.channel()];
+                if (rules.repeated_programs && !ch.bank_changed && ch.program == pev.get_program()) {
+                    remove();
+                    break;
+                }
+                ch.program = pev.get_program();
+                ch.bank_changed = false;
+            }
+            break;
+        case event_kind::PitchBend:
+            {
+                const auto& pev = static_cast<const pitchbend_message_midi_event&>(ev);
+                redundancy_channel& ch = channels[pev.channel()];
+                if (rules.repeated_pitch_bends && ch.pitch_bend == pev.get_pitch()) {
+                    remove();
+                    break;
+                }
+                ch.pitch_bend = pev.get_pitch();
+            }
+            break;
+        case event_kind::Tempo:
+            {
+                uint32_t us_per_beat = static_cast<const tempo_meta_midi_event&>(ev).get_us_per_beat();
+                if (rules.repeated_tempos && tempo == us_per_beat) {
+                    remove();
+                    break;
+                }
+                tempo = us_per_beat;
+            }
+            break;
+        case event_kind::NoteOn:
+        case event_kind::NoteOff:
+            {
+                const auto& nev = static_cast<const message_midi_event&>(ev);
+                bool on = ev.kind() == event_kind::NoteOn &&
+                    static_cast<const noteon_message_midi_event&>(ev).get_velocity() != 0;
+                uint8_t key = ev.kind() == event_kind::NoteOn ?
+                    static_cast<const noteon_message_midi_event&>(ev).get_key() :
+                    static_cast<const noteoff_message_midi_event&>(ev).get_key();
+                redundancy_note& note = notes[nev.channel() * 128u + key];
+                if (on) {
+                    if (note.sounding > 0 && rules.duplicate_note_ons && note.ticks == ev.ticks) {
+                        note.extra_offs++;
+                        remove();
+                        break;
+                    }
+                    if (note.sounding++ == 0) {
+                        note.track = mev.track;
+                        note.index = mev.index;
+                        note.ticks = ev.ticks;
+                    }
+                } else if (note.sounding > 0) {
+                    note.sounding--;
+                    if (note.sounding == 0 && note.extra_offs == 0 && rules.zero_length_notes &&
+                            note.ticks == ev.ticks && !removed[note.track][note.index]) {
+                        removed[note.track][note.index] = true;
+                        remove();
+                    }
+                } else if (note.extra_offs > 0) {
+                    note.extra_offs--;
+                    remove();
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    redundancy_report report;
+    for (size_t trk = 0; trk < midi_tracks.size(); trk++) {
+        auto& events = midi_tracks[trk].midi_events;
+        size_t kept = 0;
+        uint32_t last_before = 0, last_after = 0;
+        for (size_t i = 0; i < events.size(); i++) {
+            uint32_t ticks = events[i]->ticks;
+            report.bytes_removed += vlv_size(ticks - last_before);
+            last_before = ticks;
+            if (removed[trk][i]) {
+                report.events_removed++;
+                report.bytes_removed += events[i]->event_data().size();
+                continue;
+            }
+            report.bytes_removed -= vlv_size(ticks - last_after);
+            last_after = ticks;
+            events[kept++] = std::move(events[i]);
+        }
+        if (kept != events.size()) {
+            events.resize(kept);
+            midi_tracks[trk].touch();
+        }
+    }
+    return report;
+}
+
+//=============================================================================
+
+namespace {
+    // defined controllers whose value is a level, not a switch, selection,
+    // note number or part of a 14 bit value
+    bool is_continuous_controller(uint8_t controller) {
+        switch (controller) {
+        case MIDI_CC_MSB_MOD:
+        case MIDI_CC_MSB_BREATH:
+        case MIDI_CC_MSB_FOOT:
+        case MIDI_CC_MSB_PORT_TIME:
+        case MIDI_CC_MSB_VOLUME:
+        case MIDI_CC_MSB_BALANCE:
+        case MIDI_CC_MSB_PAN:
+        case MIDI_CC_MSB_EXPRESSION:
+        case MIDI_CC_MSB_FX_CTRL_1:
+        case MIDI_CC_MSB_FX_CTRL_2:
+        case MIDI_CC_MSB_GP_1:
+        case MIDI_CC_MSB_GP_2:
+        case MIDI_CC_MSB_GP_3:
+        case MIDI_CC_MSB_GP_4:
+            return true;
+        default:
+            return (controller >= MIDI_CC_SND_CTRL_1 && controller <= MIDI_CC_SND_CTRL_10) ||
+                (controller >= MIDI_CC_FX_DEPTH_1 && controller <= MIDI_CC_FX_DEPTH_5);
+        }
+    }
+
+    struct curve_point {
+        uint32_t ticks;
+        int32_t value;
+    };
+
+    // Linear fan simplification of one curve, marks the points to keep
+    void thin_curve(const std::vector<curve_point>& points, std::vector<bool>& keep,
+            double tolerance, uint32_t max_gap) {
+        size_t n = points.size();
+        keep.assign(n, false);
+        if (n == 0)
+            return;
+        keep[0] = keep[n - 1] = true;
+
+        // direction of the last change before a point, to find extremes
+        auto extreme = [&](size_t i, int dir_in) {
+            int dir_out = (points[i + 1].value > points[i].value) - (points[i + 1].value < points[i].value);
+            return dir_in != 0 && dir_out != 0 && dir_in != dir_out;
+        };
+
+        size_t anchor = 0;
+        double lo = -HUGE_VAL, hi = HUGE_VAL;
+        int dir = 0;
+        for (size_t i = 1; i < n; i++) {
+            const curve_point& prev = points[i - 1];
+            const curve_point& p = points[i];
+            if (i - 1 != anchor) {
+                uint32_t dt = p.ticks - points[anchor].ticks;
+                double slope = dt == 0 ? 0.0 : (p.value - points[anchor].value) / static_cast<double>(dt);
+                if (dt == 0 || dt > max_gap || slope < lo || slope > hi || extreme(i - 1, dir)) {
+                    keep[i - 1] = true;
+                    anchor = i - 1;
+                    lo = -HUGE_VAL;
+                    hi = HUGE_VAL;
+                }
+            }
+            int step = (p.value > prev.value) - (p.value < prev.value);
+            if (step != 0)
+                dir = step;
+
+            uint32_t dt = p.ticks - points[anchor].ticks;
+            if (dt == 0) {
+                // values on the same tick can't be on a line
+                keep[i] = true;
+                anchor = i;
+                continue;
+            }
+            double dv = p.value - points[anchor].value;
+            lo = std::max(lo, (dv - tolerance) / dt);
+            hi = std::min(hi, (dv + tolerance) / dt);
+        }
+    }
+}
+
+size_t cppmidi::midi_track::thin_controllers(const thinning_options& options) {
+    // one curve per channel and controller, curve 128 of a channel is pitch bend
+    constexpr size_t num_curves = 16 * 129;
+    std::vector<uint32_t> curve_of(midi_events.size(), UINT32_MAX);
+    std::vector<size_t> offsets(num_curves + 1, 0);
+    for (size_t i = 0; i < midi_events.size(); i++) {
+        const midi_event& ev = *midi_events[i];
+        if (ev.kind() == event_kind::Controller) {
+            const auto& cev = static_cast<const controller_message_midi_event&>(ev);
+            if (is_continuous_controller(cev.get_controller()))
+                curve_of[i] = cev.channel() * 129u + cev.get_controller();
+        } else if (ev.kind() == event_kind::PitchBend) {
+            curve_of[i] = static_cast<const message_midi_event&>(ev).channel() * 129u + 128u;
+        }
+        if (curve_of[i] != UINT32_MAX)
+            offsets[curve_of[i] + 1]++;
+    }
+    for (size_t c = 0; c < num_curves; c++)
+        offsets[c + 1] += offsets[c];
+    if (offsets[num_curves] == 0)
+        return 0;
+
+    // counting sort of the event positions by curve, keeping their order
+    std::vector<size_t> positions(offsets[num_curves]);
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < midi_events.size(); i++) {
+        if (curve_of[i] != UINT32_MAX)
+            positions[fill[curve_of[i]]++] = i;
+    }
+
+    std::vector<bool> removed(midi_events.size(), false);
+    std::vector<curve_point> points;
+    std::vector<bool> keep;
+    size_t num_removed = 0;
+    for (size_t c = 0; c < num_curves; c++) {
+        if (offsets[c + 1] - offsets[c] < 3)
+            continue;
+        bool bend = c % 129 == 128;
+        points.clear();
+        for (size_t k = offsets[c]; k < offsets[c + 1]; k++) {
+            const midi_event& ev = *midi_events[positions[k]];
+            int32_t value = bend ?
+                static_cast<const pitchbend_message_midi_event&>(ev).get_pitch() :
+                static_cast<const controller_message_midi_event&>(ev).get_value();
+            points.push_back(curve_point{ev.ticks, value});
+        }
+        thin_curve(points, keep, bend ? options.pitch_bend_tolerance : options.controller_tolerance,
+                options.max_gap);
+        for (size_t k = 0; k < points.size(); k++) {
+            if (!keep[k]) {
+                removed[positions[offsets[c] + k]] = true;
+                num_removed++;
+            }
+        }
+    }
+    if (num_removed == 0)
+        return 0;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < midi_events.size(); i++) {
+        if (!removed[i])
+            midi_events[kept++] = std::move(midi_events[i]);
+    }
+    midi_events.resize(kept);
+    touch();
+    return num_removed;
+}
+
+size_t cppmidi::midi_file::thin_controllers(const thinning_options& options) {
+    size_t num_events = 0;
+    for (const midi_track& mtrk : midi_tracks)
+        num_events += mtrk.midi_events.size();
+    std::vector<size_t> removed(midi_tracks.size());
+    parallel_for(midi_tracks.size(), num_events, [&](size_t i) {
+        removed[i] = midi_tracks[i].thin_controllers(options);
+    });
+    size_t total = 0;
+    for (size_t n : removed)
+        total += n;
+    return total;
+}
+
+//=============================================================================
+
+cppmidi::midi_player::midi_player(const midi_file& mf, sink output)
+    : mf(mf), tempo(mf), chaser(mf), output(std::move(output)), anchor_time_us(0), anchor_music_us(0),
+    current_time_us(0), tempo_scale(1.0), looping(false), loop_begin(0), loop_end(0),
+    sounding_channels(0), playing(false), stop_requested(false) {
+    stream.emplace(mf);
+}
+
+cppmidi::midi_player::~midi_player() {
+    stop();
+}
+
+void cppmidi::midi_player::start() {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (playing)
+        return;
+    if (thread.joinable())
+        thread.join();
+    playing = true;
+    stop_requested = false;
+    clock_origin = std::chrono::steady_clock::now() -
+        std::chrono::microseconds(current_time_us);
+    thread = std::thread(&midi_player::run, this);
+}
+
+void cppmidi::midi_player::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop_requested = true;
+    }
+    wakeup.notify_all();
+    if (thread.joinable())
+        thread.join();
+    std::lock_guard<std::mutex> lock(mtx);
+    notes_off(current_time_us);
+}
+
+bool cppmidi::midi_player::is_playing() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return playing;
+}
+
+void cppmidi::midi_player::seek(uint32_t ticks) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        current_time_us = now_locked();
+        notes_off(current_time_us);
+        chase(current_time_us, ticks);
+        anchor_time_us = current_time_us;
+        anchor_music_us = tempo.ticks_to_us(ticks);
+        stream.emplace(mf, ticks);
+    }
+    wakeup.notify_all();
+}
+
+uint32_t cppmidi::midi_player::get_position() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    double music_us = static_cast<double>(anchor_music_us) +
+        static_cast<double>(now_locked() - anchor_time_us) * tempo_scale;
+    return tempo.us_to_ticks(static_cast<uint64_t>(music_us));
+}
+
+void cppmidi::midi_player::set_loop(uint32_t begin_ticks, uint32_t end_ticks) {
+    if (tempo.ticks_to_us(begin_ticks) >= tempo.ticks_to_us(end_ticks))
+        throw xcept("Invalid loop: end must be after begin");
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        looping = true;
+        loop_begin = begin_ticks;
+        loop_end = end_ticks;
+    }
+    wakeup.notify_all();
+}
+
+void cppmidi::midi_player::clear_loop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        looping = false;
+    }
+    wakeup.notify_all();
+}
+
+void cppmidi::midi_player::set_tempo_scale(double scale) {
+    if (!(scale > 0.0))
+        throw xcept("Tempo scale must be positive");
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        current_time_us = now_locked();
+        reanchor(current_time_us);
+        tempo_scale = scale;
+    }
+    wakeup.notify_all();
+}
+
+void cppmidi::midi_player::render(uint64_t until_us) {
+    std::lock_guard<std::mutex> lock(mtx);
+    render_locked(until_us);
+}
+
+uint64_t cppmidi::midi_player::get_time() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return current_time_us;
+}
+
+bool cppmidi::midi_player::finished() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return !looping && stream->empty();
+}
+
+uint64_t cppmidi::midi_player::now_locked() const {
+    // while playing, current_time_us only advances at deadlines and wakeups
+    if (!playing)
+        return current_time_us;
+    auto now = std::chrono::steady_clock::now();
+    uint64_t now_us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - clock_origin).count());
+    return std::max(current_time_us, now_us);
+}
+
+void cppmidi::midi_player::reanchor(uint64_t time_us) {
+    double elapsed = static_cast<double>(time_us - anchor_time_us) * tempo_scale;
+    anchor_music_us += static_cast<uint64_t>(std::llround(elapsed));
+    anchor_time_us = time_us;
+}
+
+uint64_t cppmidi::midi_player::deadline(uint32_t ticks) const {
+    uint64_t music_us = tempo.ticks_to_us(ticks);
+    if (music_us <= anchor_music_us)
+        return anchor_time_us;
+    double scaled = static_cast<double>(music_us - anchor_music_us) / tempo_scale;
+    return anchor_time_us + static_cast<uint64_t>(std::llround(scaled));
+}
+
+bool cppmidi::midi_player::next_deadline(uint64_t& time_us, bool& wrap) const {
+    if (looping && (stream->empty() || stream->front().event->ticks >= loop_end)) {
+        time_us = deadline(loop_end);
+        wrap = true;
+        return true;
+    }
+    if (stream->empty())
+        return false;
+    time_us = deadline(stream->front().event->ticks);
+    wrap = false;
+    return true;
+}
+
+void cppmidi::midi_player::render_locked(uint64_t until_us) {
+    uint64_t time_us;
+    bool wrap;
+    std::vector<uint8_t> wire;
+    while (next_deadline(time_us, wrap) && time_us <= until_us) {
+        current_time_us = std::max(current_time_us, time_us);
+        if (wrap) {
+            notes_off(current_time_us);
+            chase(current_time_us, loop_begin);
+            anchor_time_us = current_time_us;
+            anchor_music_us = tempo.ticks_to_us(loop_begin);
+            stream.emplace(mf, loop_begin);
+            continue;
+        }
+
+        const midi_event& ev = *stream->front().event;
+        stream->pop();
+        switch (ev.kind()) {
+        case event_kind::Dummy:
+            continue;
+        case event_kind::SysEx:
+            {
+                const auto& sysex = static_cast<const sysex_midi_event&>(ev);
+                wire.clear();
+                if (sysex.get_first_chunk())
+                    wire.push_back(0xF0);
+                wire.insert(wire.end(), sysex.get_data().begin(), sysex.get_data().end());
+            }
+            break;
+        case event_kind::Escape:
+            wire = static_cast<const escape_midi_event&>(ev).get_data();
+            break;
+        case event_kind::NoteOn:
+            sounding_channels = static_cast<uint16_t>(sounding_channels |
+                    (1 << static_cast<const message_midi_event&>(ev).channel()));
+            wire = ev.event_data();
+            break;
+        case event_kind::NoteOff:
+        case event_kind::NoteAftertouch:
+        case event_kind::Controller:
+        case event_kind::Program:
+        case event_kind::ChannelAftertouch:
+        case event_kind::PitchBend:
+            wire = ev.event_data();
+            break;
+        default:
+            // meta events are not sent
+            continue;
+        }
+        if (!wire.empty())
+            output(current_time_us, wire.data(), wire.size());
+    }
+    current_time_us = std::max(current_time_us, until_us);
+}
+
+void cppmidi::midi_player::notes_off(uint64_t time_us) {
+    for (uint8_t ch = 0; ch < 16; ch++) {
+        if (!(sounding_channels & (1 << ch)))
+            continue;
+        const uint8_t msg[] = {
+            static_cast<uint8_t>(0xB0 | ch), MIDI_CC_ALL_NOTES_OFF, 0
+        };
+        output(time_us, msg, sizeof(msg));
+    }
+    sounding_channels = 0;
+}
+
+void cppmidi::midi_player::chase(uint64_t time_us, uint32_t ticks) {
+    std::array<channel_state, 16> state = chaser.state_at(ticks);
+    midi_track restore;
+    for (uint8_t ch = 0; ch < 16; ch++)
+        state[ch].append_events(restore, ticks, ch);
+    for (const auto& ev : restore.midi_events) {
+        std::vector<uint8_t> wire = ev->event_data();
+        output(time_us, wire.data(), wire.size());
+    }
+}
+
+void cppmidi::midi_player::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!stop_requested) {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t now_us = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - clock_origin).count());
+        render_locked(now_us);
+
+        uint64_t time_us;
+        bool wrap;
+        if (!next_deadline(time_us, wrap))
+            break;
+        // woken up early by stop(), seek() and other changes
+        wakeup.wait_until(lock, clock_origin + std::chrono::microseconds(time_us));
+    }
+    playing = false;
+}
+
+//=============================================================================
+
+cppmidi::mapped_file::mapped_file(const std::filesystem::path& file_path, bool writable)
+    : writable(writable), file_path(file_path) {
+#ifdef CPPMIDI_HAVE_MMAP
+    int fd = open(file_path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        throw xcept("Error mapping file: %s", strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw xcept("Failed to obtain file size: %s", strerror(err));
+    }
+    map_size = static_cast<size_t>(st.st_size);
+    if (map_size > 0) {
+        void *addr = mmap(nullptr, map_size,
+                writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            throw xcept("Error mapping file: %s", strerror(err));
+        }
+        map_data = static_cast<uint8_t *>(addr);
+    }
+    // the mapping stays valid after closing the descriptor
+    close(fd);
+#else
+    std::ifstream is(file_path, std::ios_base::binary);
+    if (!is.is_open())
+        throw xcept("Error mapping file: %s", strerror(errno));
+    is.seekg(0, std::ios_base::end);
+    std::streampos size = is.tellg();
+    is.seekg(0, std::ios_base::beg);
+    if (size < 0)
+        throw xcept("Failed to obtain file size: %s", strerror(errno));
+    fallback_buffer.resize(static_cast<size_t>(size));
+    is.read(reinterpret_cast<char *>(fallback_buffer.data()),
+            static_cast<std::streamsize>(fallback_buffer.size()));
+    if (is.bad())
+        throw xcept("std::ifstream::read bad");
+    if (is.fail())
+        throw xcept("std::ifstream::read fail");
+    map_data = fallback_buffer.data();
+    map_size = fallback_buffer.size();
+#endif
+}
+
+cppmidi::mapped_file::mapped_file(mapped_file&& other) noexcept
+    : map_data(other.map_data), map_size(other.map_size), writable(other.writable),
+    file_path(std::move(other.file_path)),
+    fallback_buffer(std::move(other.fallback_buffer)) {
+    other.map_data = nullptr;
+    other.map_size = 0;
+}
+
+cppmidi::mapped_file& cppmidi::mapped_file::operator=(mapped_file&& other) noexcept {
+    if (this != &other) {
+        unmap();
+        map_data = other.map_data;
+        map_size = other.map_size;
+        writable = other.writable;
+        file_path = std::move(other.file_path);
+        fallback_buffer = std::move(other.fallback_buffer);
+        other.map_data = nullptr;
+        other.map_size = 0;
+    }
+    return *this;
+}
+
+cppmidi::mapped_file::~mapped_file() {
+    unmap();
+}
+
+void cppmidi::mapped_file::unmap() noexcept {
+#ifdef CPPMIDI_HAVE_MMAP
+    if (map_data)
+        munmap(map_data, map_size);
+#endif
+    map_data = nullptr;
+    map_size = 0;
+}
+
+void cppmidi::mapped_file::sync() {
+    if (!writable || !map_data)
+        return;
+#ifdef CPPMIDI_HAVE_MMAP
+    if (msync(map_data, map_size, MS_SYNC) != 0)
+        throw xcept("Error syncing mapped file: %s", strerror(errno));
+#else
+    write_file(file_path, fallback_buffer, "Error syncing mapped file: %s");
+#endif
+}
+
+//=============================================================================
+
+static const char snapshot_magic[8] = { 'C', 'P', 'P', 'M', 'I', 'D', 'I', 'S' };
+static const uint32_t snapshot_byte_order = 0x01020304;
+
+// the record layout is part of the file format
+static_assert(sizeof(cppmidi::snapshot_header) == 56, "snapshot_header layout changed");
+static_assert(sizeof(cppmidi::snapshot_event) == 16, "snapshot_event layout changed");
+
+static uint64_t fnv1a_hash(const uint8_t *data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325uLL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3uLL;
+    }
+    return hash;
+}
+
+void cppmidi::midi_snapshot::save(const midi_file& mf, const std::filesystem::path& file_path) {
+    size_t num_events = 0;
+    for (const midi_track& mtrk : mf.midi_tracks)
+        num_events += mtrk.midi_events.size();
+
+    std::vector<uint64_t> track_offsets;
+    track_offsets.reserve(mf.midi_tracks.size() + 1);
+    std::vector<snapshot_event> events;
+    events.reserve(num_events);
+    std::vector<uint8_t> heap;
+
+    auto add_payload = [&](snapshot_event& rec, const uint8_t *data, size_t size) {
+        if (heap.size() + size > UINT32_MAX)
+            throw xcept("Snapshot payload heap exceeds 4 GiB");
+        rec.value = static_cast<uint32_t>(heap.size());
+        rec.size = static_cast<uint32_t>(size);
+        heap.insert(heap.end(), data, data + size);
+    };
+    auto add_text = [&](snapshot_event& rec, const std::string& text) {
+        add_payload(rec, reinterpret_cast<const uint8_t *>(text.data()), text.size());
+    };
+
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        track_offsets.push_back(events.size());
+        for (const auto& ev_ptr : mtrk.midi_events) {
+            const midi_event& ev = *ev_ptr;
+            snapshot_event rec{ev.ticks, ev.kind(), 0, 0, 0, 0, 0};
+            switch (ev.kind()) {
+            case event_kind::Dummy:
+            case event_kind::EndOfTrack:
+                break;
+            case event_kind::NoteOff:
+                {
+                    auto& e = static_cast<const noteoff_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_key(); rec.c = e.get_velocity();
+                }
+                break;
+            case event_kind::NoteOn:
+                {
+                    auto& e = static_cast<const noteon_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_key(); rec.c = e.get_velocity();
+                }
+                break;
+            case event_kind::NoteAftertouch:
+                {
+                    auto& e = static_cast<const noteaftertouch_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_key(); rec.c = e.get_value();
+                }
+                break;
+            case event_kind::Controller:
+                {
+                    auto& e = static_cast<const controller_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_controller(); rec.c = e.get_value();
+                }
+                break;
+            case event_kind::Program:
+                {
+                    auto& e = static_cast<const program_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_program();
+                }
+                break;
+            case event_kind::ChannelAftertouch:
+                {
+                    auto& e = static_cast<const channelaftertouch_message_midi_event&>(ev);
+                    rec.a = e.channel(); rec.b = e.get_value();
+                }
+                break;
+            case event_kind::PitchBend:
+                {
+                    auto& e = static_cast<const pitchbend_message_midi_event&>(ev);
+                    rec.a = e.channel();
+                    rec.value = static_cast<uint16_t>(e.get_pitch());
+                }
+                break;
+            case event_kind::SequenceNumber:
+                {
+                    auto& e = static_cast<const sequencenumber_meta_midi_event&>(ev);
+                    rec.value = e.get_seq_num();
+                    rec.b = e.get_empty();
+                }
+                break;
+            case event_kind::Text:
+                add_text(rec, static_cast<const text_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::Copyright:
+                add_text(rec, static_cast<const copyright_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::TrackName:
+                add_text(rec, static_cast<const trackname_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::Instrument:
+                add_text(rec, static_cast<const instrument_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::Lyric:
+                add_text(rec, static_cast<const lyric_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::Marker:
+                add_text(rec, static_cast<const marker_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::CuePoint:
+                add_text(rec, static_cast<const cuepoint_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::ProgramName:
+                add_text(rec, static_cast<const programname_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::DeviceName:
+                add_text(rec, static_cast<const devicename_meta_midi_event&>(ev).get_text());
+                break;
+            case event_kind::ChannelPrefix:
+                rec.a = static_cast<const channelprefix_meta_midi_event&>(ev).get_channel();
+                break;
+            case event_kind::MidiPort:
+                rec.a = static_cast<const midiport_meta_midi_event&>(ev).get_port();
+                break;
+            case event_kind::Tempo:
+                rec.value = static_cast<const tempo_meta_midi_event&>(ev).get_us_per_beat();
+                break;
+            case event_kind::SmpteOffset:
+                {
+                    auto& e = static_cast<const smpteoffset_meta_midi_event&>(ev);
+                    rec.a = e.get_frame_rate(); rec.b = e.get_hour(); rec.c = e.get_minute();
+                    rec.value = static_cast<uint32_t>(e.get_second() |
+                            (e.get_frames() << 8) | (e.get_frame_fractions() << 16));
+                }
+                break;
+            case event_kind::TimeSignature:
+                {
+                    auto& e = static_cast<const timesignature_meta_midi_event&>(ev);
+                    rec.a = e.get_numerator(); rec.b = e.get_denominator();
+                    rec.c = e.get_tick_clocks(); rec.value = e.get_n32n();
+                }
+                break;
+            case event_kind::KeySignature:
+                {
+                    auto& e = static_cast<const keysignature_meta_midi_event&>(ev);
+                    rec.a = static_cast<uint8_t>(e.get_sharp_flats());
+                    rec.b = e.get_minor();
+                }
+                break;
+            case event_kind::SequencerSpecific:
+                {
+                    auto& data = static_cast<const sequencerspecific_meta_midi_event&>(ev).get_data();
+                    add_payload(rec, data.data(), data.size());
+                }
+                break;
+            case event_kind::SysEx:
+                {
+                    auto& e = static_cast<const sysex_midi_event&>(ev);
+                    add_payload(rec, e.get_data().data(), e.get_data().size());
+                    rec.b = e.get_first_chunk();
+                }
+                break;
+            case event_kind::Escape:
+                {
+                    auto& data = static_cast<const escape_midi_event&>(ev).get_data();
+                    add_payload(rec, data.data(), data.size());
+                }
+                break;
+            }
+            events.push_back(rec);
+        }
+    }
+    track_offsets.push_back(events.size());
+
+    size_t offsets_size = track_offsets.size() * sizeof(uint64_t);
+    size_t events_size = events.size() * sizeof(snapshot_event);
+    std::vector<uint8_t> data(sizeof(snapshot_header) + offsets_size + events_size + heap.size());
+    uint8_t *content = data.data() + sizeof(snapshot_header);
+    memcpy(content, track_offsets.data(), offsets_size);
+    memcpy(content + offsets_size, events.data(), events_size);
+    if (!heap.empty())
+        memcpy(content + offsets_size + events_size, heap.data(), heap.size());
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = format_version;
+    header.byte_order = snapshot_byte_order;
+    header.time_division = mf.time_division;
+    header.num_tracks = static_cast<uint32_t>(mf.midi_tracks.size());
+    header.num_events = events.size();
+    header.heap_size = heap.size();
+    header.content_hash = fnv1a_hash(content, data.size() - sizeof(snapshot_header));
+    memcpy(data.data(), &header, sizeof(header));
+
+    write_file(file_path, data, "Error saving MIDI snapshot: %s");
+}
+
+cppmidi::midi_snapshot::midi_snapshot(const std::filesystem::path& file_path, bool verify_hash)
+    : mapping(file_path) {
+    if (mapping.size() < sizeof(snapshot_header))
+        throw xcept("Bad MIDI snapshot: file too small");
+    const snapshot_header& hdr = header();
+    if (memcmp(hdr.magic, snapshot_magic, sizeof(hdr.magic)) != 0)
+        throw xcept("Bad MIDI snapshot magic");
+    if (hdr.byte_order != snapshot_byte_order)
+        throw xcept("MIDI snapshot was created with a different byte order");
+    if (hdr.version != format_version)
+        throw xcept("Unsupported MIDI snapshot version: %u", hdr.version);
+
+    // compute in 64 bit to not overflow with malicious headers
+    uint64_t offsets_size = (static_cast<uint64_t>(hdr.num_tracks) + 1) * sizeof(uint64_t);
+    if (hdr.num_events > mapping.size() / sizeof(snapshot_event) ||
+            hdr.heap_size > mapping.size() ||
+            sizeof(snapshot_header) + offsets_size + hdr.num_events * sizeof(snapshot_event) +
+            hdr.heap_size != mapping.size())
+        throw xcept("Bad MIDI snapshot: inconsistent size");
+
+    const uint8_t *content = mapping.data() + sizeof(snapshot_header);
+    if (verify_hash && fnv1a_hash(content, mapping.size() - sizeof(snapshot_header)) !=
+            hdr.content_hash)
+        throw xcept("Bad MIDI snapshot: content hash mismatch");
+
+    track_offsets = reinterpret_cast<const uint64_t *>(content);
+    events = reinterpret_cast<const snapshot_event *>(content + offsets_size);
+    heap = content + offsets_size + hdr.num_events * sizeof(snapshot_event);
+
+    if (track_offsets[0] != 0 || track_offsets[hdr.num_tracks] != hdr.num_events)
+        throw xcept("Bad MIDI snapshot: inconsistent track table");
+    for (uint32_t trk = 0; trk < hdr.num_tracks; trk++) {
+        if (track_offsets[trk] > track_offsets[trk + 1])
+            throw xcept("Bad MIDI snapshot: inconsistent track table");
+    }
+}
+
+std::unique_ptr<cppmidi::midi_event> cppmidi::midi_snapshot::make_event(
+        const snapshot_event& ev) const {
+    if (ev.size != 0 && static_cast<uint64_t>(ev.value) + ev.size > header().heap_size)
+        throw xcept("Bad MIDI snapshot: payload out of range");
+    const char *text = reinterpret_cast<const char *>(payload(ev));
+    const uint8_t *data = payload(ev);
+
+    switch (ev.kind) {
+    case event_kind::Dummy:
+        return std::make_unique<dummy_midi_event>(ev.ticks);
+    case event_kind::NoteOff:
+        return std::make_unique<noteoff_message_midi_event>(ev.ticks, ev.a, ev.b, ev.c);
+    case event_kind::NoteOn:
+        return std::make_unique<noteon_message_midi_event>(ev.ticks, ev.a, ev.b, ev.c);
+    case event_kind::NoteAftertouch:
+        return std::make_unique<noteaftertouch_message_midi_event>(ev.ticks, ev.a, ev.b, ev.c);
+    case event_kind::Controller:
+        return std::make_unique<controller_message_midi_event>(ev.ticks, ev.a, ev.b, ev.c);
+    case event_kind::Program:
+        return std::make_unique<program_message_midi_event>(ev.ticks, ev.a, ev.b);
+    case event_kind::ChannelAftertouch:
+        return std::make_unique<channelaftertouch_message_midi_event>(ev.ticks, ev.a, ev.b);
+    case event_kind::PitchBend:
+        return std::make_unique<pitchbend_message_midi_event>(ev.ticks, ev.a,
+                static_cast<int16_t>(static_cast<uint16_t>(ev.value)));
+    case event_kind::SequenceNumber:
+        if (ev.b)
+            return std::make_unique<sequencenumber_meta_midi_event>(ev.ticks);
+        return std::make_unique<sequencenumber_meta_midi_event>(ev.ticks,
+                static_cast<uint16_t>(ev.value));
+    case event_kind::Text:
+        return std::make_unique<text_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::Copyright:
+        return std::make_unique<copyright_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::TrackName:
+        return std::make_unique<trackname_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::Instrument:
+        return std::make_unique<instrument_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::Lyric:
+        return std::make_unique<lyric_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::Marker:
+        return std::make_unique<marker_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::CuePoint:
+        return std::make_unique<cuepoint_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::ProgramName:
+        return std::make_unique<programname_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::DeviceName:
+        return std::make_unique<devicename_meta_midi_event>(ev.ticks, std::string(text, ev.size));
+    case event_kind::ChannelPrefix:
+        return std::make_unique<channelprefix_meta_midi_event>(ev.ticks, ev.a);
+    case event_kind::MidiPort:
+        return std::make_unique<midiport_meta_midi_event>(ev.ticks, ev.a);
+    case event_kind::EndOfTrack:
+        return std::make_unique<endoftrack_meta_midi_event>(ev.ticks);
+    case event_kind::Tempo:
+        return std::make_unique<tempo_meta_midi_event>(ev.ticks, ev.value);
+    case event_kind::SmpteOffset:
+        return std::make_unique<smpteoffset_meta_midi_event>(ev.ticks, ev.a, ev.b, ev.c,
+                static_cast<uint8_t>(ev.value), static_cast<uint8_t>(ev.value >> 8),
+                static_cast<uint8_t>(ev.value >> 16));
+    case event_kind::TimeSignature:
+        return std::make_unique<timesignature_meta_midi_event>(ev.ticks, ev.a, ev.b, ev.c,
+                static_cast<uint8_t>(ev.value));
+    case event_kind::KeySignature:
+        return std::make_unique<keysignature_meta_midi_event>(ev.ticks,
+                static_cast<int8_t>(ev.a), ev.b != 0);
+    case event_kind::SequencerSpecific:
+        return std::make_unique<sequencerspecific_meta_midi_event>(ev.ticks,
+                std::vector<uint8_t>(data, data + ev.size));
+    case event_kind::SysEx:
+        return std::make_unique<sysex_midi_event>(ev.ticks,
+                std::vector<uint8_t>(data, data + ev.size), ev.b != 0);
+    case event_kind::Escape:
+        return std::make_unique<escape_midi_event>(ev.ticks,
+                std::vector<uint8_t>(data, data + ev.size));
+    }
+    throw xcept("Bad MIDI snapshot: unknown event kind %u", static_cast<uint32_t>(ev.kind));
+}
+
+cppmidi::midi_file cppmidi::midi_snapshot::to_midi_file() const {
+    midi_file mf;
+    mf.time_division = time_division();
+    mf.midi_tracks.resize(num_tracks());
+    for (size_t trk = 0; trk < num_tracks(); trk++) {
+        auto& events = mf.midi_tracks[trk].midi_events;
+        events.reserve(static_cast<size_t>(track_end(trk) - track_begin(trk)));
+        for (const snapshot_event *ev = track_begin(trk); ev != track_end(trk); ev++)
+            events.emplace_back(make_event(*ev));
+    }
+    return mf;
+}
+
+void cppmidi::midi_file::load_from_snapshot(const std::filesystem::path& file_path) {
+    *this = midi_snapshot(file_path).to_midi_file();
+}
+
+void cppmidi::midi_file::save_to_snapshot(const std::filesystem::path& file_path) const {
+    midi_snapshot::save(*this, file_path);
+}
+
+//=============================================================================
+
+cppmidi::raw_track_decoder::raw_track_decoder(uint8_t *track_begin, uint8_t *track_end,
+        size_t track)
+    : pos(track_begin), end(track_end), track(track), current_tick(0),
+    running_status(0), done(false) {
+}
+
+bool cppmidi::raw_track_decoder::next(raw_event& ev) {
+    if (done)
+        return false;
+
+    auto read_byte = [&]() -> uint8_t {
+        if (pos >= end)
+            throw xcept("MIDI parser error: Unexpected end of track %zu", track);
+        return *pos++;
+    };
+    auto read_len = [&]() -> uint32_t {
+        uint32_t retval;
+        size_t size = decode_vlv(pos, end, retval);
+        if (size == 0)
+            throw xcept("Failed to read VLV (too big or cut off) in track %zu", track);
+        pos += size;
+        return retval;
+    };
+
+    uint64_t overflow_tick = current_tick + static_cast<uint64_t>(read_len());
+    if (overflow_tick >= 0x100000000)
+        throw xcept("MIDI parser: Too many ticks for int32");
+    current_tick = static_cast<uint32_t>(overflow_tick);
+
+    ev.ticks = current_tick;
+    ev.track = track;
+    ev.meta_type = 0;
+    ev.status_ptr = pos;
+    uint8_t status = read_byte();
+    if (status < 0x80) {
+        // running status, the byte just read is the first data byte
+        if (running_status == 0)
+            throw xcept("MIDI parser error: Use of running state without inital command "
+                    "in track %zu", track);
+        pos--;
+        ev.status_ptr = nullptr;
+        status = running_status;
+    }
+    ev.status = status;
+
+    if (status < 0xF0) {
+        running_status = status;
+        uint8_t type = static_cast<uint8_t>(status >> 4);
+        ev.size = (type == 0xC || type == 0xD) ? 1 : 2;
+    } else if (status == 0xFF) {
+        ev.meta_type = read_byte();
+        ev.size = read_len();
+    } else if (status == 0xF0 || status == 0xF7) {
+        ev.size = read_len();
+    } else {
+        throw xcept("MIDI parser error: Bad Byte 0x%X in track %zu", status, track);
+    }
+
+    if (static_cast<size_t>(end - pos) < ev.size)
+        throw xcept("MIDI parser error: Event reaching over end of track %zu", track);
+    ev.data = pos;
+    pos += ev.size;
+
+    if (status == 0xFF && ev.meta_type == 0x2F) {
+        done = true;
+        if (pos != end)
+            throw xcept("MIDI error: Incorrect Track Length for track %zu", track);
+        return false;
+    }
+    return true;
+}
+
+cppmidi::raw_midi_data::raw_midi_data(uint8_t *data, size_t size, bool writable)
+    : writable(writable) {
+    if (size < 0xE)
+        throw xcept("Bad MIDI file: too small");
+    throw_assert(data[0], 'M', "Bad MIDI magic");
+    throw_assert(data[1], 'T', "Bad MIDI magic");
+    throw_assert(data[2], 'h', "Bad MIDI magic");
+    throw_assert(data[3], 'd', "Bad MIDI magic");
+    throw_assert(data[4], 0, "Bad File Header chunk len");
+    throw_assert(data[5], 0, "Bad File Header chunk len");
+    throw_assert(data[6], 0, "Bad File Header chunk len");
+    throw_assert(data[7], 6, "Bad File Header chunk len");
+
+    midi_type = static_cast<uint16_t>((data[8] << 8) | data[9]);
+    if (midi_type > 2)
+        throw xcept("Illegal MIDI file type: %u", midi_type);
+    uint16_t num_tracks = static_cast<uint16_t>((data[0xA] << 8) | data[0xB]);
+    time_division = static_cast<uint16_t>((data[0xC] << 8) | data[0xD]);
+
+    size_t fpos = 0xE;
+    for (uint16_t trk = 0; trk < num_tracks; trk++) {
+        if (size - fpos < 8)
+            throw xcept("Bad MIDI file: missing track %u", trk);
+        throw_assert(data[fpos + 0], 'M', "Bad MIDI Track Magic");
+        throw_assert(data[fpos + 1], 'T', "Bad MIDI Track Magic");
+        throw_assert(data[fpos + 2], 'r', "Bad MIDI Track Magic");
+        throw_assert(data[fpos + 3], 'k', "Bad MIDI Track Magic");
+        uint32_t track_length = static_cast<uint32_t>(
+                (data[fpos + 4] << 24) |
+                (data[fpos + 5] << 16) |
+                (data[fpos + 6] << 8) |
+                data[fpos + 7]);
+        fpos += 8;
+        if (size - fpos < track_length)
+            throw xcept("Bad MIDI file: track %u reaching over end of file", trk);
+        tracks.emplace_back(data + fpos, data + fpos + track_length);
+        fpos += track_length;
+    }
+}
+
+void cppmidi::raw_midi_data::validate() const {
+    raw_event ev;
+    for (size_t trk = 0; trk < tracks.size(); trk++) {
+        raw_track_decoder dec = decoder(trk);
+        while (dec.next(ev)) {}
+    }
+}
+
+void cppmidi::raw_midi_data::prepare_modify() const {
+    if (!writable)
+        throw xcept("Cannot modify read-only MIDI data");
+    validate();
+}
+
+//=============================================================================
+
+cppmidi::channel_message_map::channel_message_map() {
+    table identity;
+    for (uint8_t i = 0; i < 128; i++)
+        identity[i] = i;
+    key.fill(identity);
+    velocity.fill(identity);
+    program.fill(identity);
+    for (uint8_t ch = 0; ch < 16; ch++)
+        channel[ch] = ch;
+}
+
+void cppmidi::channel_message_map::transpose(int semitones, uint16_t channel_mask) {
+    for (size_t ch = 0; ch < 16; ch++) {
+        if (!(channel_mask & (1 << ch)))
+            continue;
+        for (int k = 0; k < 128; k++)
+            key[ch][static_cast<size_t>(k)] = static_cast<uint8_t>(std::clamp(k + semitones, 0, 127));
+    }
+}
+
+void cppmidi::channel_message_map::scale_velocity(double factor, uint16_t channel_mask) {
+    for (size_t ch = 0; ch < 16; ch++) {
+        if (!(channel_mask & (1 << ch)))
+            continue;
+        for (int v = 0; v < 128; v++) {
+            long scaled = std::lround(v * factor);
+            velocity[ch][static_cast<size_t>(v)] = static_cast<uint8_t>(std::clamp(scaled, 0L, 127L));
+        }
+    }
+}
+
+namespace {
+    // which of the tables of a map are not identity
+    struct map_usage {
+        explicit map_usage(const cppmidi::channel_message_map& map) {
+            cppmidi::channel_message_map identity;
+            keys = map.key != identity.key;
+            velocities = map.velocity != identity.velocity;
+            programs = map.program != identity.program;
+            channels = map.channel != identity.channel;
+        }
+        bool keys, velocities, programs, channels;
+    };
+
+    inline uint8_t map_velocity(const cppmidi::channel_message_map::table& table, uint8_t vel) {
+        // note on with velocity 0 is a note off and has to stay one
+        return vel == 0 ? 0 : std::max<uint8_t>(1, table[vel & 0x7F]);
+    }
+}
+
+void cppmidi::channel_message_map::apply(midi_track& mtrk) const {
+    map_usage use(*this);
+    kind_mask mask = 0;
+    if (use.keys)
+        mask |= kind_bit(event_kind::NoteOff) | kind_bit(event_kind::NoteAftertouch);
+    if (use.keys || use.velocities)
+        mask |= kind_bit(event_kind::NoteOn);
+    if (use.programs)
+        mask |= kind_bit(event_kind::Program);
+    if (use.channels) {
+        for (event_kind k : {event_kind::NoteOff, event_kind::NoteOn, event_kind::NoteAftertouch,
+                event_kind::Controller, event_kind::Program, event_kind::ChannelAftertouch,
+                event_kind::PitchBend})
+            mask |= kind_bit(k);
+    }
+    if (mask == 0)
+        return;
+
+    mtrk.touch_contents();
+    mtrk.for_each_of_kinds(mask, [&](size_t pos) {
+        midi_event& ev = *mtrk.midi_events[pos];
+        auto& mev = static_cast<message_midi_event&>(ev);
+        uint8_t ch = mev.channel();
+        switch (ev.kind()) {
+        case event_kind::NoteOff:
+            {
+                auto& nev = static_cast<noteoff_message_midi_event&>(ev);
+                nev.set_key(key[ch][nev.get_key()]);
+            }
+            break;
+        case event_kind::NoteOn:
+            {
+                auto& nev = static_cast<noteon_message_midi_event&>(ev);
+                nev.set_key(key[ch][nev.get_key()]);
+                nev.set_velocity(map_velocity(velocity[ch], nev.get_velocity()));
+            }
+            break;
+        case event_kind::NoteAftertouch:
+            {
+                auto& nev = static_cast<noteaftertouch_message_midi_event&>(ev);
+                nev.set_key(key[ch][nev.get_key()]);
+            }
+            break;
+        case event_kind::Program:
+            {
+                auto& pev = static_cast<program_message_midi_event&>(ev);
+                pev.set_program(program[ch][pev.get_program()]);
+            }
+            break;
+        default:
+            break;
+        }
+        mev.set_channel(channel[ch]);
+    });
+}
+
+void cppmidi::channel_message_map::apply(midi_file& mf) const {
+    size_t num_events = 0;
+    for (const midi_track& mtrk : mf.midi_tracks)
+        num_events += mtrk.midi_events.size();
+    parallel_for(mf.midi_tracks.size(), num_events, [&](size_t i) {
+        apply(mf.midi_tracks[i]);
+    });
+}
+
+void cppmidi::channel_message_map::apply(raw_midi_data& raw) const {
+    map_usage use(*this);
+    if (!use.keys && !use.velocities && !use.programs && !use.channels)
+        return;
+
+    raw.modify_each_event([&](const raw_event& ev) {
+        if (!ev.is_channel_message())
+            return;
+        uint8_t ch = ev.channel();
+        switch (ev.message_type()) {
+        case 0x8:
+        case 0xA:
+            ev.data[0] = static_cast<uint8_t>(key[ch][ev.data[0] & 0x7F] & 0x7F);
+            break;
+        case 0x9:
+            ev.data[0] = static_cast<uint8_t>(key[ch][ev.data[0] & 0x7F] & 0x7F);
+            ev.data[1] = static_cast<uint8_t>(map_velocity(velocity[ch], ev.data[1]) & 0x7F);
+            break;
+        case 0xC:
+            ev.data[0] = static_cast<uint8_t>(program[ch][ev.data[0] & 0x7F] & 0x7F);
+            break;
+        default:
+            break;
+        }
+        // events using running status share the rewritten status byte
+        if (ev.status_ptr)
+            *ev.status_ptr = static_cast<uint8_t>((ev.status & 0xF0) | (channel[ch] & 0xF));
+    });
+}
+
+//=============================================================================
+
+// end of track event with zero delta time
+static const uint8_t eot_bytes[] = { 0x00, 0xFF, 0x2F, 0x00 };
+
+cppmidi::midi_append_writer::midi_append_writer(const std::filesystem::path& file_path,
+        uint16_t time_division, uint16_t midi_type)
+    : midi_type(midi_type), num_tracks(0), chunk_len_pos(0), eot_pos(0),
+    last_event_time(0), running_status(0) {
+    if (midi_type > 1)
+        throw xcept("Saving MIDI file type %u is not supported", midi_type);
+    if (time_division & 0x8000)
+        throw xcept("frames/second time division: unsupported");
+
+    file.open(file_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        throw xcept("Error creating MIDI File: %s", strerror(errno));
+
+    const uint8_t header[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6,
+        static_cast<uint8_t>(midi_type >> 8), static_cast<uint8_t>(midi_type),
+        0, 0,
+        static_cast<uint8_t>(time_division >> 8), static_cast<uint8_t>(time_division),
+    };
+    write_at(0, header, sizeof(header));
+    new_track();
+}
+
+cppmidi::midi_append_writer::midi_append_writer(const std::filesystem::path& file_path)
+    : midi_type(1), num_tracks(0), chunk_len_pos(0), eot_pos(0),
+    last_event_time(0), running_status(0) {
+    file.open(file_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.is_open())
+        throw xcept("Error opening MIDI File: %s", strerror(errno));
+
+    std::vector<uint8_t> midi_data((std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+    if (file.bad())
+        throw xcept("std::fstream::read bad");
+    file.clear();
+
+    throw_assert(midi_data.at(0), 'M', "Bad MIDI magic");
+    throw_assert(midi_data.at(1), 'T', "Bad MIDI magic");
+    throw_assert(midi_data.at(2), 'h', "Bad MIDI magic");
+    throw_assert(midi_data.at(3), 'd', "Bad MIDI magic");
+    throw_assert(midi_data.at(7), 6, "Bad File Header chunk len");
+    midi_type = static_cast<uint16_t>((midi_data.at(8) << 8) | midi_data.at(9));
+    if (midi_type > 1)
+        throw xcept("Appending to MIDI file type %u is not supported", midi_type);
+    num_tracks = static_cast<uint16_t>((midi_data.at(0xA) << 8) | midi_data.at(0xB));
+    if (num_tracks == 0)
+        throw xcept("Cannot append to MIDI file without tracks");
+
+    // skip to the last track chunk
+    size_t fpos = 0xE;
+    uint32_t track_length = 0;
+    for (uint16_t trk = 0; trk < num_tracks; trk++) {
+        throw_assert(midi_data.at(fpos + 0), 'M', "Bad MIDI Track Magic");
+        throw_assert(midi_data.at(fpos + 1), 'T', "Bad MIDI Track Magic");
+        throw_assert(midi_data.at(fpos + 2), 'r', "Bad MIDI Track Magic");
+        throw_assert(midi_data.at(fpos + 3), 'k', "Bad MIDI Track Magic");
+        chunk_len_pos = fpos + 4;
+        track_length = static_cast<uint32_t>(
+                (midi_data.at(fpos + 4) << 24) |
+                (midi_data.at(fpos + 5) << 16) |
+                (midi_data.at(fpos + 6) << 8) |
+                midi_data.at(fpos + 7));
+        fpos += 8;
+        if (trk + 1 < num_tracks)
+            fpos += track_length;
+    }
+    if (fpos + track_length != midi_data.size())
+        throw xcept("Cannot append to MIDI file: data after last track");
+
+    // decode the last track to find the end of track event, the last tick
+    // and the running status in effect
+    uint8_t current_midi_channel = 0;
+    running_state current_state = running_state::Undef;
+    bool sysex_ongoing = false;
+    while (1) {
+        size_t event_pos = fpos;
+        uint32_t current_tick = last_event_time + read_vlv(midi_data, fpos);
+        std::unique_ptr<midi_event> ev = read_event(midi_data, fpos,
+                current_midi_channel, current_state, sysex_ongoing, current_tick);
+        if (!ev) {
+            eot_pos = event_pos;
+            break;
+        }
+        last_event_time = current_tick;
+        // skip the delta time to get to the status byte (if any)
+        while (midi_data[event_pos] & 0x80)
+            event_pos++;
+        uint8_t status = midi_data[event_pos + 1];
+        if (status >= 0xF0)
+            running_status = 0;
+        else if (status & 0x80)
+            running_status = status;
+    }
+}
+
+cppmidi::midi_append_writer::~midi_append_writer() {
+    try {
+        flush();
+    } catch (...) {
+    }
+}
+
+void cppmidi::midi_append_writer::append(const midi_event& ev) {
+    if (ev.kind() == event_kind::EndOfTrack)
+        return;
+    if (ev.ticks < last_event_time)
+        throw xcept("Cannot append event at tick %u after tick %u", ev.ticks, last_event_time);
+    encode_track_event(pending, ev, last_event_time, running_status);
+}
+
+void cppmidi::midi_append_writer::new_track() {
+    if (num_tracks != 0 && midi_type == 0)
+        throw xcept("MIDI type 0 files can only have one track");
+    if (num_tracks == 0xFFFF)
+        throw xcept("Too many tracks");
+    flush();
+
+    file.seekp(0, std::ios::end);
+    uint64_t chunk_pos = static_cast<uint64_t>(file.tellp());
+    const uint8_t chunk[] = { 'M', 'T', 'r', 'k', 0, 0, 0, sizeof(eot_bytes) };
+    write_at(chunk_pos, chunk, sizeof(chunk));
+    write_at(chunk_pos + sizeof(chunk), eot_bytes, sizeof(eot_bytes));
+
+    num_tracks++;
+    const uint8_t ntrk[] = {
+        static_cast<uint8_t>(num_tracks >> 8), static_cast<uint8_t>(num_tracks)
+    };
+    write_at(0xA, ntrk, sizeof(ntrk));
+
+    chunk_len_pos = chunk_pos + 4;
+    eot_pos = chunk_pos + sizeof(chunk);
+    last_event_time = 0;
+    running_status = 0;
+    file.flush();
+}
+
+void cppmidi::midi_append_writer::flush() {
+    if (pending.empty())
+        return;
+
+    // overwrite the old end of track event, then append a new one
+    pending.insert(pending.end(), std::begin(eot_bytes), std::end(eot_bytes));
+    write_at(eot_pos, pending.data(), pending.size());
+    eot_pos += pending.size() - sizeof(eot_bytes);
+    pending.clear();
+
+    uint64_t track_len = eot_pos + sizeof(eot_bytes) - (chunk_len_pos + 4);
+    if (track_len > UINT32_MAX)
+        throw xcept("MIDI track exceeds 4 GiB");
+    const uint8_t len[] = {
+        static_cast<uint8_t>(track_len >> 24), static_cast<uint8_t>(track_len >> 16),
+        static_cast<uint8_t>(track_len >> 8), static_cast<uint8_t>(track_len),
+    };
+    write_at(chunk_len_pos, len, sizeof(len));
+    file.flush();
+    if (file.fail())
+        throw xcept("std::fstream::flush fail");
+}
+
+void cppmidi::midi_append_writer::write_at(uint64_t pos, const uint8_t *data, size_t size) {
+    file.seekp(static_cast<std::streamoff>(pos));
+    file.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+    if (file.bad())
+        throw xcept("std::fstream::write bad");
+    if (file.fail())
+        throw xcept("std::fstream::write fail");
+}
+
+//=============================================================================
+
+namespace {
+    // Myers' diff of two sequences of event ids, split at middle snakes so
+    // only linear extra space is used
+    class track_differ {
+    public:
+        struct edit {
+            bool insert;
+            size_t old_index;
+            size_t new_index;
+        };
+
+        track_differ(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b)
+            : a(a), b(b) {}
+
+        std::vector<edit> run() {
+            diff(0, a.size(), 0, b.size());
+            return std::move(edits);
+        }
+    private:
+        void diff(size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi) {
+            while (a_lo < a_hi && b_lo < b_hi && a[a_lo] == b[b_lo]) {
+                a_lo++;
+                b_lo++;
+            }
+            while (a_lo < a_hi && b_lo < b_hi && a[a_hi - 1] == b[b_hi - 1]) {
+                a_hi--;
+                b_hi--;
+            }
+            if (a_lo == a_hi || b_lo == b_hi) {
+                for (size_t i = a_lo; i < a_hi; i++)
+                    edits.push_back(edit{false, i, b_lo});
+                for (size_t j = b_lo; j < b_hi; j++)
+                    edits.push_back(edit{true, a_hi, j});
+                return;
+            }
+
+            size_t x, y;
+            if (middle_snake(a_lo, a_hi, b_lo, b_hi, x, y)) {
+                diff(a_lo, x, b_lo, y);
+                diff(x, a_hi, y, b_hi);
+            } else {
+                for (size_t i = a_lo; i < a_hi; i++)
+                    edits.push_back(edit{false, i, b_lo});
+                for (size_t j = b_lo; j < b_hi; j++)
+                    edits.push_back(edit{true, a_hi, j});
+            }
+        }
+
+        // Searches forward and backward paths at once until they overlap,
+        // (x, y) is where the forward path reached the overlap.
+        bool middle_snake(size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi,
+                size_t& x, size_t& y) {
+            const auto n = static_cast<ptrdiff_t>(a_hi - a_lo);
+            const auto m = static_cast<ptrdiff_t>(b_hi - b_lo);
+            const ptrdiff_t max_d = (n + m + 1) / 2;
+            const ptrdiff_t offset = max_d;
+            const ptrdiff_t length = 2 * max_d + 2;
+            forward.assign(static_cast<size_t>(length), -1);
+            backward.assign(static_cast<size_t>(length), -1);
+            auto fw = [&](ptrdiff_t k) -> ptrdiff_t& { return forward[static_cast<size_t>(offset + k)]; };
+            auto bw = [&](ptrdiff_t k) -> ptrdiff_t& { return backward[static_cast<size_t>(offset + k)]; };
+            auto eq_fw = [&](ptrdiff_t i, ptrdiff_t j) {
+                return a[a_lo + static_cast<size_t>(i)] == b[b_lo + static_cast<size_t>(j)];
+            };
+            auto eq_bw = [&](ptrdiff_t i, ptrdiff_t j) {
+                return a[a_hi - 1 - static_cast<size_t>(i)] == b[b_hi - 1 - static_cast<size_t>(j)];
+            };
+            fw(1) = 0;
+            bw(1) = 0;
+            const ptrdiff_t delta = n - m;
+            const bool front = (delta % 2) != 0;
+            ptrdiff_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+
+            for (ptrdiff_t d = 0; d < max_d; d++) {
+                for (ptrdiff_t k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+                    ptrdiff_t x1 = (k1 == -d || (k1 != d && fw(k1 - 1) < fw(k1 + 1))) ?
+                        fw(k1 + 1) : fw(k1 - 1) + 1;
+                    ptrdiff_t y1 = x1 - k1;
+                    while (x1 < n && y1 < m && eq_fw(x1, y1)) {
+                        x1++;
+                        y1++;
+                    }
+                    fw(k1) = x1;
+                    if (x1 > n) {
+                        k1_end += 2;
+                    } else if (y1 > m) {
+                        k1_start += 2;
+                    } else if (front) {
+                        ptrdiff_t k2 = delta - k1;
+                        if (k2 >= -max_d && k2 <= max_d && bw(k2) != -1 && x1 >= n - bw(k2)) {
+                            x = a_lo + static_cast<size_t>(x1);
+                            y = b_lo + static_cast<size_t>(y1);
+                            return true;
+                        }
+                    }
+                }
+                for (ptrdiff_t k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+                    ptrdiff_t x2 = (k2 == -d || (k2 != d && bw(k2 - 1) < bw(k2 + 1))) ?
+                        bw(k2 + 1) : bw(k2 - 1) + 1;
+                    ptrdiff_t y2 = x2 - k2;
+                    while (x2 < n && y2 < m && eq_bw(x2, y2)) {
+                        x2++;
+                        y2++;
+                    }
+                    bw(k2) = x2;
+                    if (x2 > n) {
+                        k2_end += 2;
+                    } else if (y2 > m) {
+                        k2_start += 2;
+                    } else if (!front) {
+                        ptrdiff_t k1 = delta - k2;
+                        if (k1 >= -max_d && k1 <= max_d && fw(k1) != -1) {
+                            ptrdiff_t x1 = fw(k1);
+                            if (x1 >= n - x2) {
+                                x = a_lo + static_cast<size_t>(x1);
+                                y = b_lo + static_cast<size_t>(x1 - k1);
+                                return true;
+                            }
+                        }
+                    }
+                }
+            }
+            return false;
+        }
+
+        const std::vector<uint32_t>& a;
+        const std::vector<uint32_t>& b;
+        std::vector<edit> edits;
+        std::vector<ptrdiff_t> forward;
+        std::vector<ptrdiff_t> backward;
+    };
+
+    // what makes events equal for diffing: ticks, kind and data
+    void event_key(const cppmidi::midi_event& ev, std::string& key) {
+        std::vector<uint8_t> data = ev.event_data();
+        key.clear();
+        key.append(reinterpret_cast<const char *>(&ev.ticks), sizeof(ev.ticks));
+        key.push_back(static_cast<char>(ev.kind()));
+        key.append(data.begin(), data.end());
+    }
+
+    uint64_t event_fingerprint(const cppmidi::midi_event& ev) {
+        std::string key;
+        event_key(ev, key);
+        return fnv1a_hash(reinterpret_cast<const uint8_t *>(key.data()), key.size());
+    }
+
+    // Gives equal events of both tracks the same id
+    void intern_events(const cppmidi::midi_track& older, const cppmidi::midi_track& newer,
+            std::vector<uint32_t>& old_ids, std::vector<uint32_t>& new_ids) {
+        std::unordered_map<std::string, uint32_t> ids;
+        std::string key;
+        auto intern = [&](const cppmidi::midi_event& ev) {
+            event_key(ev, key);
+            return ids.emplace(key, static_cast<uint32_t>(ids.size())).first->second;
+        };
+        for (const auto& ev : older.midi_events)
+            old_ids.push_back(intern(*ev));
+        for (const auto& ev : newer.midi_events)
+            new_ids.push_back(intern(*ev));
+    }
+
+    std::vector<cppmidi::diff_op> diff_tracks(const cppmidi::midi_track& older,
+            const cppmidi::midi_track& newer, size_t track) {
+        using namespace cppmidi;
+        std::vector<uint32_t> old_ids, new_ids;
+        intern_events(older, newer, old_ids, new_ids);
+        std::vector<track_differ::edit> edits = track_differ(old_ids, new_ids).run();
+
+        // Hunks are runs of consecutive removed events and the events inserted
+        // at their end. Removed and inserted events at the start of a hunk
+        // are paired up as modifications while their kinds match.
+        std::vector<diff_op> ops;
+        size_t e = 0;
+        while (e < edits.size()) {
+            size_t hunk_end = edits[e].old_index + (edits[e].insert ? 0 : 1);
+            size_t last = e + 1;
+            while (last < edits.size()) {
+                const track_differ::edit& next = edits[last];
+                if (next.old_index != hunk_end)
+                    break;
+                if (!next.insert)
+                    hunk_end++;
+                last++;
+            }
+
+            std::vector<const track_differ::edit *> removes, inserts;
+            for (size_t i = e; i < last; i++)
+                (edits[i].insert ? inserts : removes).push_back(&edits[i]);
+            size_t paired = 0;
+            while (paired < removes.size() && paired < inserts.size() &&
+                    older.midi_events[removes[paired]->old_index]->kind() ==
+                    newer.midi_events[inserts[paired]->new_index]->kind())
+                paired++;
+
+            for (size_t i = 0; i < removes.size(); i++) {
+                uint64_t fingerprint = event_fingerprint(*older.midi_events[removes[i]->old_index]);
+                if (i < paired) {
+                    ops.push_back(diff_op{diff_op_type::Modify, track, removes[i]->old_index,
+                            inserts[i]->new_index, newer.midi_events[inserts[i]->new_index]->clone(),
+                            fingerprint});
+                } else {
+                    ops.push_back(diff_op{diff_op_type::Remove, track, removes[i]->old_index,
+                            0, nullptr, fingerprint});
+                }
+            }
+            for (size_t i = paired; i < inserts.size(); i++) {
+                ops.push_back(diff_op{diff_op_type::Insert, track, hunk_end,
+                        inserts[i]->new_index, newer.midi_events[inserts[i]->new_index]->clone(), 0});
+            }
+            e = last;
+        }
+        return ops;
+    }
+}
+
+cppmidi::midi_patch cppmidi::diff_files(const midi_file& older, const midi_file& newer) {
+    midi_patch patch;
+    patch.old_time_division = older.time_division;
+    patch.time_division = newer.time_division;
+    patch.old_num_tracks = older.midi_tracks.size();
+    patch.num_tracks = newer.midi_tracks.size();
+
+    // tracks only in the new file are compared against empty ones
+    midi_track empty;
+    std::vector<std::vector<diff_op>> track_ops(newer.midi_tracks.size());
+    size_t num_events = 0;
+    for (const midi_track& mtrk : older.midi_tracks)
+        num_events += mtrk.midi_events.size();
+    for (const midi_track& mtrk : newer.midi_tracks)
+        num_events += mtrk.midi_events.size();
+    parallel_for(newer.midi_tracks.size(), num_events, [&](size_t trk) {
+        const midi_track& old_track = trk < older.midi_tracks.size() ? older.midi_tracks[trk] : empty;
+        track_ops[trk] = diff_tracks(old_track, newer.midi_tracks[trk], trk);
+    });
+
+    patch.old_track_sizes.resize(std::max(older.midi_tracks.size(), newer.midi_tracks.size()));
+    for (size_t trk = 0; trk < older.midi_tracks.size(); trk++)
+        patch.old_track_sizes[trk] = older.midi_tracks[trk].midi_events.size();
+    for (auto& ops : track_ops) {
+        std::move(ops.begin(), ops.end(), std::back_inserter(patch.ops));
+    }
+    return patch;
+}
+
+bool cppmidi::midi_patch::empty() const {
+    return ops.empty() && old_num_tracks == num_tracks && old_time_division == time_division;
+}
+
+void cppmidi::midi_patch::apply(midi_file& mf) const {
+    if (mf.time_division != old_time_division)
+        throw xcept("Patch for time division 0x%X, file has 0x%X",
+                old_time_division, mf.time_division);
+    if (mf.midi_tracks.size() != old_num_tracks)
+        throw xcept("Patch for %zu tracks, file has %zu", old_num_tracks, mf.midi_tracks.size());
+    for (size_t trk = 0; trk < old_num_tracks && trk < old_track_sizes.size(); trk++) {
+        if (mf.midi_tracks[trk].midi_events.size() != old_track_sizes[trk])
+            throw xcept("Patch doesn't match track %zu: %zu events instead of %zu",
+                    trk, mf.midi_tracks[trk].midi_events.size(), old_track_sizes[trk]);
+    }
+
+    // check everything before the file is modified
+    for (size_t op = 0; op < ops.size(); op++) {
+        const diff_op& d = ops[op];
+        if (d.track >= num_tracks)
+            throw xcept("Bad patch: track %zu out of range", d.track);
+        if (op > 0 && (d.track < ops[op - 1].track ||
+                    (d.track == ops[op - 1].track && d.index < ops[op - 1].index)))
+            throw xcept("Bad patch: ops out of order in track %zu", d.track);
+        size_t size = d.track < old_num_tracks ? mf.midi_tracks[d.track].midi_events.size() : 0;
+        if (d.type == diff_op_type::Insert) {
+            if (d.index > size || !d.event)
+                throw xcept("Bad patch: insert at %zu in track %zu", d.index, d.track);
+            continue;
+        }
+        if (d.index >= size)
+            throw xcept("Bad patch: index %zu out of range in track %zu", d.index, d.track);
+        if (op > 0 && d.track == ops[op - 1].track && d.index == ops[op - 1].index &&
+                ops[op - 1].type != diff_op_type::Insert)
+            throw xcept("Bad patch: event %zu of track %zu changed twice", d.index, d.track);
+        if ((d.type == diff_op_type::Modify && !d.event) ||
+                event_fingerprint(*mf.midi_tracks[d.track].midi_events[d.index]) != d.old_fingerprint)
+            throw xcept("Patch doesn't match event %zu of track %zu", d.index, d.track);
+    }
+
+    if (num_tracks > mf.midi_tracks.size())
+        mf.midi_tracks.resize(num_tracks);
+    size_t op = 0;
+    while (op < ops.size()) {
+        size_t track = ops[op].track;
+        auto& events = mf.midi_tracks[track].midi_events;
+        std::vector<std::unique_ptr<midi_event>> result;
+        result.reserve(events.size());
+        size_t pos = 0;
+        for (; op < ops.size() && ops[op].track == track; op++) {
+            const diff_op& d = ops[op];
+            for (; pos < d.index; pos++)
+                result.push_back(std::move(events[pos]));
+            if (d.type != diff_op_type::Remove)
+                result.push_back(d.event->clone());
+            if (d.type != diff_op_type::Insert)
+                pos++;
+        }
+        for (; pos < events.size(); pos++)
+            result.push_back(std::move(events[pos]));
+        events.swap(result);
+        mf.midi_tracks[track].touch();
+    }
+
+    mf.midi_tracks.resize(num_tracks);
+    mf.time_division = time_division;
+}
+
+//=============================================================================
+
 cppmidi::xcept::xcept(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -8,6 +8,18 @@
 #include <memory>
 #include <exception>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <array>
+#include <bitset>
+#include <type_traits>
 
 #define MIDI_CC_MSB_BANK_SELECT 0
 #define MIDI_CC_MSB_MOD         1
@@ -96,6 +108,7 @@ namespace cppmidi {
     //=========================================================================
 
     class visitor;
+    struct channel_message_map;
     class dummy_midi_event;
     class noteoff_message_midi_event;
     class noteon_message_midi_event;
@@ -131,6 +144,67 @@ namespace cppmidi {
 
     uint32_t read_vlv(const std::vector<uint8_t>& midi_data, size_t& fpos);
 
+    // Allocation free VLV primitives working on plain byte buffers.
+    // A 32 bit value takes at most max_vlv_size bytes.
+    constexpr size_t max_vlv_size = 5;
+
+    inline size_t vlv_size(uint32_t value) {
+        // (significant bits + 6) / 7, with at least one byte for 0
+#if defined(__GNUC__) || defined(__clang__)
+        unsigned int leading_zeros = static_cast<unsigned int>(__builtin_clz(value | 1));
+#else
+        unsigned int leading_zeros = 31;
+        for (uint32_t v = (value | 1) >> 1; v; v >>= 1)
+            leading_zeros--;
+#endif
+        return (38 - leading_zeros) / 7;
+    }
+
+    // Always writes max_vlv_size bytes to out and returns how many of them
+    // belong to the VLV of value.
+    inline size_t encode_vlv(uint32_t value, uint8_t *out) {
+        size_t size = vlv_size(value);
+        // spread the 7 bit groups over the bytes of a 64 bit int, least
+        // significant group first, and set the continuation bits
+        uint64_t v = value;
+        uint64_t groups = (v & 0x7F) | ((v << 1) & 0x7F00) | ((v << 2) & 0x7F0000) |
+            ((v << 3) & 0x7F000000) | ((v << 4) & 0x7F00000000);
+        groups |= 0x8080808000 & ((1uLL << (8 * size)) - 1);
+        // move the first byte of the VLV to the top
+        groups <<= 8 * (8 - size);
+        out[0] = static_cast<uint8_t>(groups >> 56);
+        out[1] = static_cast<uint8_t>(groups >> 48);
+        out[2] = static_cast<uint8_t>(groups >> 40);
+        out[3] = static_cast<uint8_t>(groups >> 32);
+        out[4] = static_cast<uint8_t>(groups >> 24);
+        return size;
+    }
+
+    // Reads a VLV from [data, end) and returns the number of bytes consumed.
+    // Returns 0 if the VLV is cut off or doesn't fit into 32 bits.
+    inline size_t decode_vlv(const uint8_t *data, const uint8_t *end, uint32_t& value) {
+        if (data < end && !(data[0] & 0x80)) {
+            value = data[0];
+            return 1;
+        }
+        size_t avail = static_cast<size_t>(end - data);
+        uint32_t result = 0;
+        for (size_t i = 0; i < max_vlv_size && i < avail; i++) {
+            result = (result << 7) | (data[i] & 0x7F);
+            if (!(data[i] & 0x80)) {
+                if (i == max_vlv_size - 1 && (data[0] & 0x70))
+                    return 0;
+                value = result;
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    // Decodes count consecutive VLVs from [data, end) into values and returns
+    // the number of bytes consumed. Throws if there are not enough valid VLVs.
+    size_t decode_vlvs(const uint8_t *data, const uint8_t *end, uint32_t *values, size_t count);
+
     enum class running_state {
         Undef,
         NoteOff,
@@ -142,11 +216,54 @@ namespace cppmidi {
         PitchBend,
     };
 
+    // One value per event class, in the same order as the visit() overloads
+    enum class event_kind : uint8_t {
+        Dummy,
+        NoteOff,
+        NoteOn,
+        NoteAftertouch,
+        Controller,
+        Program,
+        ChannelAftertouch,
+        PitchBend,
+        SequenceNumber,
+        Text,
+        Copyright,
+        TrackName,
+        Instrument,
+        Lyric,
+        Marker,
+        CuePoint,
+        ProgramName,
+        DeviceName,
+        ChannelPrefix,
+        MidiPort,
+        EndOfTrack,
+        Tempo,
+        SmpteOffset,
+        TimeSignature,
+        KeySignature,
+        SequencerSpecific,
+        SysEx,
+        Escape,
+    };
+    constexpr size_t num_event_kinds = static_cast<size_t>(event_kind::Escape) + 1;
+
+    // set of event kinds, one bit per kind
+    using kind_mask = uint32_t;
+    constexpr kind_mask kind_bit(event_kind kind) {
+        return kind_mask(1) << static_cast<unsigned int>(kind);
+    }
+    constexpr kind_mask all_kinds = (kind_mask(1) << num_event_kinds) - 1;
+
     class midi_event {
     public:
         virtual ~midi_event() = default;
         virtual std::vector<uint8_t> event_data() const = 0;
         uint32_t ticks;
+        event_kind kind() const { return ev_kind; }
+        // deep copy of the event
+        virtual std::unique_ptr<midi_event> clone() const = 0;
 
         virtual void accept(visitor& v) = 0;
         virtual void print(std::ostream& os, const std::string& indent) const = 0;
@@ -155,16 +272,72 @@ namespace cppmidi {
             return os;
         }
     protected:
-        midi_event(uint32_t ticks) : ticks(ticks) {}
+        midi_event(uint32_t ticks, event_kind kind) : ticks(ticks), ev_kind(kind) {}
+    private:
+        event_kind ev_kind;
     };
 
     std::unique_ptr<midi_event> read_event(const std::vector<uint8_t>& midi_data,
             size_t& fpos, uint8_t& current_midi_channel, running_state& current_rs,
             bool& sysex_ongoing, uint32_t current_tick);
 
+    enum class tick_rounding {
+        Down, Nearest, Up
+    };
+
+    // Order of events with equal ticks when sorting. Events with a lower rank
+    // come first, events with equal rank keep their order. By default all
+    // ranks are equal, i.e. only ticks are sorted.
+    struct event_order {
+        std::array<uint8_t, num_event_kinds> rank{};
+
+        uint8_t& operator[](event_kind kind) { return rank[static_cast<size_t>(kind)]; }
+        uint8_t operator[](event_kind kind) const { return rank[static_cast<size_t>(kind)]; }
+
+        // meta events, sysex, note offs, other channel messages, note ons,
+        // end of track
+        static event_order meta_first();
+    };
+
+    // Rules of midi_file::remove_redundant_events
+    struct redundancy_rules {
+        // controllers set to the value they already have, except data entry,
+        // data increment/decrement and channel mode messages
+        bool repeated_controllers = true;
+        // program changes to the current program, unless the bank changed
+        bool repeated_programs = true;
+        bool repeated_pitch_bends = true;
+        bool repeated_tempos = true;
+        // note ons ended at the same tick, together with their note off
+        bool zero_length_notes = true;
+        // note ons of a key already started at the same tick, together with
+        // one of the note offs
+        bool duplicate_note_ons = true;
+    };
+
+    struct redundancy_report {
+        size_t events_removed = 0;
+        // size of the removed events in the saved file, including changes of
+        // the delta times but not of running status
+        size_t bytes_removed = 0;
+    };
+
+    // Tolerances of midi_track::thin_controllers
+    struct thinning_options {
+        // how far the dropped points may be off the line between kept ones
+        uint8_t controller_tolerance = 1;
+        uint16_t pitch_bend_tolerance = 64;
+        // Kept points are at most max_gap ticks apart (unless there are no
+        // events in between). Playback holds each value until the next
+        // event, so this limits how coarse simplified ramps get.
+        uint32_t max_gap = 16;
+    };
+
     struct midi_track {
         std::vector<std::unique_ptr<midi_event>> midi_events;
 
+        // Element access and iteration don't count as modification, call
+        // touch() after modifying events through them.
         const std::unique_ptr<midi_event>& operator[](size_t i) const {
             return midi_events[i];
         }
@@ -176,13 +349,159 @@ namespace cppmidi {
         auto end() { return midi_events.end(); }
         auto end() const { return midi_events.end(); }
 
-        void sort_events();
+        // Stable sort by ticks. Already sorted tracks are detected in O(n) and
+        // left untouched, nearly sorted ones are merged from their sorted runs,
+        // large ones are radix sorted.
+        void sort_events(const event_order& order = event_order());
+
+        // Bulk tick transforms. They keep the order of events and either
+        // transform all events or throw on int32 tick overflow and leave the
+        // track unchanged.
+        // ticks = ticks * num / den
+        void rescale_ticks(uint32_t num, uint32_t den,
+                tick_rounding rounding = tick_rounding::Down);
+        // negative results are clamped to 0
+        void shift_ticks(int64_t offset);
+        // Moves events by strength (0..1) towards the nearest grid line. Swing
+        // (0..<1) delays every second grid line by that fraction of the grid.
+        void quantize_ticks(uint32_t grid, double strength = 1.0, double swing = 0.0);
+
+        // Simplifies the curves of continuous controllers and pitch bends per
+        // channel in linear time. Points of a curve are dropped while a line
+        // from the last kept point passes all of them within the tolerance.
+        // The first and last point and local extremes are always kept, as are
+        // switches, portamento control, bank select, (N)RPN, data entry, LSBs,
+        // channel mode and undefined controllers. The track has to be sorted.
+        // Returns the number of removed events.
+        size_t thin_controllers(const thinning_options& options = thinning_options());
+
+        // Every modification through the methods above bumps the generation
+        // counter, which invalidates data cached for this track (the seek and
+        // kind indexes and the encoded MTrk chunk optionally reused by
+        // midi_file::save_to_file). If you modify midi_events directly, or
+        // events through iterators or pointers you kept around, call touch()
+        // before the track is used again.
+        //
+        // The caches are built by const methods and guarded by a lock, so a
+        // track can be used from several threads as long as none modifies it.
+        void touch() { generation++; }
+        // Like touch(), for modifications which don't replace, add, remove or
+        // reorder events. Keeps the kind index below.
+        void touch_contents() {
+            bool keep = stamp_matches(kind_index_stamp);
+            touch();
+            if (keep)
+                kind_index_stamp = current_stamp();
+        }
+        uint64_t get_generation() const { return generation; }
+
+        // Appends the track as MTrk chunk to data. With use_cache the encoding
+        // is cached and reused as long as the generation doesn't change; only
+        // use it if every modification is followed by touch().
+        void encode_chunk(std::vector<uint8_t>& data, bool use_cache = false) const;
+
+        // Returns the index of the first event with at least the given ticks.
+        // Events have to be sorted. The first call after a modification builds
+        // a sampled seek index in O(n), following calls take O(log n).
+        size_t lower_bound(uint32_t ticks) const;
+
+        // Positions of the events of a kind, in track order. The index for all
+        // kinds is built in O(n) on first use after a modification.
+        struct kind_positions {
+            const size_t *first;
+            const size_t *last;
+            const size_t *begin() const { return first; }
+            const size_t *end() const { return last; }
+            size_t size() const { return static_cast<size_t>(last - first); }
+            bool empty() const { return first == last; }
+        };
+        kind_positions positions_of(event_kind kind) const {
+            build_kind_index();
+            size_t k = static_cast<size_t>(kind);
+            return kind_positions{kind_index_positions.data() + kind_index_offsets[k],
+                kind_index_positions.data() + kind_index_offsets[k + 1]};
+        }
+
+        // Calls f(position) for the events of the given kinds in track order,
+        // without looking at other events.
+        template<typename F>
+        void for_each_of_kinds(kind_mask mask, F&& f) const {
+            build_kind_index();
+            const size_t *cursors[num_event_kinds];
+            const size_t *ends[num_event_kinds];
+            size_t num_cursors = 0;
+            for (size_t k = 0; k < num_event_kinds; k++) {
+                if (!(mask & kind_bit(static_cast<event_kind>(k))) ||
+                        kind_index_offsets[k] == kind_index_offsets[k + 1])
+                    continue;
+                cursors[num_cursors] = kind_index_positions.data() + kind_index_offsets[k];
+                ends[num_cursors] = kind_index_positions.data() + kind_index_offsets[k + 1];
+                num_cursors++;
+            }
+            // merge the position lists, there are only a few of them
+            while (num_cursors > 1) {
+                size_t min = 0;
+                for (size_t c = 1; c < num_cursors; c++) {
+                    if (*cursors[c] < *cursors[min])
+                        min = c;
+                }
+                f(*cursors[min]);
+                if (++cursors[min] == ends[min]) {
+                    num_cursors--;
+                    cursors[min] = cursors[num_cursors];
+                    ends[min] = ends[num_cursors];
+                }
+            }
+            if (num_cursors == 1) {
+                for (const size_t *pos = cursors[0]; pos != ends[0]; pos++)
+                    f(*pos);
+            }
+        }
 
         void print(std::ostream& os, const std::string& indent) const;
         friend std::ostream& operator<<(std::ostream& os, const midi_track& trk) {
             trk.print(os, "");
             return os;
         }
+    private:
+        // identifies the state of the track a cache was built from
+        struct cache_stamp {
+            bool valid = false;
+            uint64_t generation = 0;
+            size_t size = 0;
+            const void *data = nullptr;
+        };
+        cache_stamp current_stamp() const {
+            return cache_stamp{true, generation, midi_events.size(), midi_events.data()};
+        }
+        bool stamp_matches(const cache_stamp& stamp) const {
+            return stamp.valid && stamp.generation == generation &&
+                stamp.size == midi_events.size() && stamp.data == midi_events.data();
+        }
+
+        // a mutex which isn't copied along with the track
+        struct cache_lock {
+            cache_lock() = default;
+            cache_lock(const cache_lock&) noexcept {}
+            cache_lock& operator=(const cache_lock&) noexcept { return *this; }
+            std::mutex mtx;
+        };
+
+        uint64_t generation = 0;
+        mutable cache_lock cache_mtx;
+        mutable std::vector<uint8_t> encoded_chunk_cache;
+        mutable cache_stamp encoded_chunk_stamp;
+
+        // ticks of every seek_index_stride'th event
+        static constexpr size_t seek_index_stride = 16;
+        mutable std::vector<uint32_t> seek_index;
+        mutable cache_stamp seek_index_stamp;
+
+        // positions of kind k are kind_index_positions[offsets[k]..offsets[k + 1]]
+        void build_kind_index() const;
+        mutable std::vector<size_t> kind_index_positions;
+        mutable std::array<size_t, num_event_kinds + 1> kind_index_offsets{};
+        mutable cache_stamp kind_index_stamp;
     };
 
     struct midi_file {
@@ -203,22 +522,128 @@ namespace cppmidi {
         midi_file() : time_division(48) {}
 
         void load_from_file(const std::filesystem::path& file_path);
-        void save_to_file(const std::filesystem::path& file_path) const;
-        void sort_track_events();
+        // applies map to the raw bytes before they are parsed
+        void load_from_file(const std::filesystem::path& file_path,
+                const channel_message_map& map);
+        // midi_type 0 merges all tracks into a single one, 1 saves tracks as they are.
+        // reuse_chunks reuses the encoding of tracks unchanged since the last
+        // save with it, see midi_track::encode_chunk.
+        void save_to_file(const std::filesystem::path& file_path,
+                uint16_t midi_type = 1, bool reuse_chunks = false) const;
+        // sorts tracks in parallel, see midi_track::sort_events
+        void sort_track_events(const event_order& order = event_order());
         void convert_time_division(uint16_t time_division);
+        // like the midi_track tick transforms, tracks are processed in parallel
+        void rescale_ticks(uint32_t num, uint32_t den,
+                tick_rounding rounding = tick_rounding::Down);
+        void shift_ticks(int64_t offset);
+        void quantize_ticks(uint32_t grid, double strength = 1.0, double swing = 0.0);
+        // thins all tracks in parallel, see midi_track::thin_controllers
+        size_t thin_controllers(const thinning_options& options = thinning_options());
+
+        // Returns the events in [tick_begin, tick_end) with ticks relative to
+        // tick_begin. Tracks have to be sorted. The controller, program, pitch
+        // bend and tempo state at tick_begin is inserted at tick 0, notes still
+        // sounding at tick_end are ended there and note offs of notes started
+        // before tick_begin are dropped. Every track ends at the window length.
+        midi_file slice(uint32_t tick_begin, uint32_t tick_end) const&;
+        // moves the events out of the file instead of copying them, the file
+        // keeps the events which weren't moved into the slice
+        midi_file slice(uint32_t tick_begin, uint32_t tick_end) &&;
+        // Slices many (possibly overlapping) windows, preparing the state
+        // chase only once.
+        std::vector<midi_file> slice(
+                const std::vector<std::pair<uint32_t, uint32_t>>& windows) const;
+
+        // Removes events which don't change playback in one pass over all
+        // tracks in time order. Channel and tempo state is shared between
+        // tracks like on a synth. Tracks have to be sorted.
+        redundancy_report remove_redundant_events(
+                const redundancy_rules& rules = redundancy_rules());
+
+        // Snapshots store the decoded file in a library defined binary format,
+        // see midi_snapshot
+        void load_from_snapshot(const std::filesystem::path& file_path);
+        void save_to_snapshot(const std::filesystem::path& file_path) const;
+
+        // marks all tracks as modified
+        void touch() {
+            for (midi_track& mtrk : midi_tracks)
+                mtrk.touch();
+        }
 
         void print(std::ostream& os, const std::string& indent) const;
         friend std::ostream& operator<<(std::ostream& os, const midi_file& mf) {
             mf.print(os, "");
             return os;
         }
+    private:
+        void load_from_data(const std::vector<uint8_t>& midi_data);
+    };
+
+    // Builds a sorted track from events added in any order. Events which are
+    // not earlier than the last one are appended, late ones are collected
+    // and merged into the tail of the track in batches. Events with equal
+    // ticks keep the order in which they were added.
+    class track_builder {
+    public:
+        explicit track_builder(size_t max_pending = 256) : max_pending(max_pending) {}
+
+        void add(std::unique_ptr<midi_event> ev);
+        template<typename T, typename... Args>
+        void emplace(Args&&... args) {
+            add(std::make_unique<T>(std::forward<Args>(args)...));
+        }
+        size_t size() const { return events.size() + pending.size(); }
+
+        // merges all late events into the track
+        void flush();
+        // returns the sorted track and leaves the builder empty
+        midi_track finalize();
+    private:
+        size_t max_pending;
+        std::vector<std::unique_ptr<midi_event>> events;
+        std::vector<std::unique_ptr<midi_event>> pending;
+    };
+
+    // Combines several files into one. Inputs are converted to the target
+    // time division and shifted by their offset (in target ticks) when they
+    // are added, finish() merges the (sorted) tracks mapped to the same
+    // output track with a k-way merge. Events on equal ticks keep the order
+    // in which their inputs were added. End of track events are replaced by
+    // a single one at the end of each output track.
+    class midi_merger {
+    public:
+        explicit midi_merger(uint16_t time_division) : time_division(time_division) {}
+
+        // Track i of the input goes to output track track_map[i]. Without a
+        // map the input tracks are appended as new output tracks.
+        midi_merger& add(const midi_file& mf, uint32_t offset = 0,
+                std::vector<size_t> track_map = {});
+        // moves the events instead of copying them
+        midi_merger& add(midi_file&& mf, uint32_t offset = 0,
+                std::vector<size_t> track_map = {});
+
+        // returns the merged file and leaves the merger empty
+        midi_file finish();
+    private:
+        struct input {
+            midi_file file;
+            std::vector<size_t> track_map;
+        };
+
+        uint16_t time_division;
+        size_t num_tracks = 0;
+        std::vector<input> inputs;
     };
 
     //=========================================================================
 
     class visitor {
     public:
+        virtual ~visitor() = default;
         void visit(midi_track& mtrk) {
+            mtrk.touch();
             for (auto& mevt : mtrk.midi_events) {
                 mevt->accept(*this);
             }
@@ -260,14 +685,30 @@ namespace cppmidi {
         visitor() = default;
     };
 
+    // Visits the tracks of a file on num_workers threads (0: one per core).
+    // Tracks are distributed by event count, largest first, to the least
+    // loaded worker. factory(trk) is called for every track on the calling
+    // thread and each track is visited with its own visitor. Afterwards
+    // reduce is called with the visitors in track order, so results are
+    // combined the same way on every machine, whatever num_workers is.
+    void parallel_visit(midi_file& mf,
+            const std::function<std::unique_ptr<visitor>(size_t trk)>& factory,
+            const std::function<void(visitor&)>& reduce = nullptr,
+            size_t num_workers = 0);
+    // shares one visitor between all workers, it must be thread safe
+    void parallel_visit(midi_file& mf, visitor& v, size_t num_workers = 0);
+
     //=========================================================================
 
     // The dummy event is nothing specified by midi.
     // It's intended to be used by the user program only
     class dummy_midi_event : public midi_event {
     public:
-        dummy_midi_event(uint32_t ticks) : midi_event(ticks) {}
+        dummy_midi_event(uint32_t ticks) : midi_event(ticks, event_kind::Dummy) {}
         std::vector<uint8_t> event_data() const override;
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<dummy_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     };
@@ -275,9 +716,12 @@ namespace cppmidi {
     class message_midi_event : public midi_event {
     public:
         uint8_t channel() const { return midi_channel; }
+        void set_channel(uint8_t midi_channel) {
+            this->midi_channel = static_cast<uint8_t>(midi_channel & 0xF);
+        }
     protected:
-        message_midi_event(uint32_t ticks, uint8_t midi_channel)
-            : midi_event(ticks), midi_channel(midi_channel & 0xF) {}
+        message_midi_event(uint32_t ticks, event_kind kind, uint8_t midi_channel)
+            : midi_event(ticks, kind), midi_channel(midi_channel & 0xF) {}
         uint8_t midi_channel;
     };
 
@@ -287,7 +731,7 @@ namespace cppmidi {
     public:
         noteoff_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t key, uint8_t velocity)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::NoteOff, midi_channel),
             key(key & 0x7F), velocity(velocity & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_key() const { return key; }
@@ -298,6 +742,9 @@ namespace cppmidi {
         void set_velocity(uint8_t velocity) {
             this->velocity = static_cast<uint8_t>(velocity & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<noteoff_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -308,7 +755,7 @@ namespace cppmidi {
     public:
         noteon_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t key, uint8_t velocity)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::NoteOn, midi_channel),
             key(key & 0x7F), velocity(velocity & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_key() const { return key; }
@@ -319,6 +766,9 @@ namespace cppmidi {
         void set_velocity(uint8_t velocity ) {
             this->velocity = static_cast<uint8_t>(velocity & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<noteon_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -329,7 +779,7 @@ namespace cppmidi {
     public:
         noteaftertouch_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t key, uint8_t value)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::NoteAftertouch, midi_channel),
             key(key & 0x7F), value(value & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_key() const { return key; }
@@ -340,6 +790,9 @@ namespace cppmidi {
         void set_value(uint8_t value) {
             this->value = static_cast<uint8_t>(value & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<noteaftertouch_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -350,7 +803,7 @@ namespace cppmidi {
     public:
         controller_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t controller, uint8_t value)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::Controller, midi_channel),
             controller(controller & 0x7F), value(value & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_controller() const { return controller; }
@@ -361,6 +814,9 @@ namespace cppmidi {
         void set_value(uint8_t value) {
             this->value = static_cast<uint8_t>(value & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<controller_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -371,13 +827,16 @@ namespace cppmidi {
     public:
         program_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t program)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::Program, midi_channel),
             program(program & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_program() const { return program; }
         void set_program(uint8_t program) {
             this->program = static_cast<uint8_t>(program & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<program_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -388,13 +847,16 @@ namespace cppmidi {
     public:
         channelaftertouch_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 uint8_t value)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::ChannelAftertouch, midi_channel),
             value(value & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_value() const { return value; }
         void set_value(uint8_t value) {
             this->value = static_cast<uint8_t>(value & 0x7F);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<channelaftertouch_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -405,13 +867,16 @@ namespace cppmidi {
     public:
         pitchbend_message_midi_event(uint32_t ticks, uint8_t midi_channel,
                 int16_t pitch)
-            : message_midi_event(ticks, midi_channel),
+            : message_midi_event(ticks, event_kind::PitchBend, midi_channel),
             pitch(pitch) {}
         std::vector<uint8_t> event_data() const override;
         int16_t get_pitch() const { return pitch; }
         void set_pitch(int16_t pitch) {
             this->pitch = std::clamp<int16_t>(pitch, -0x2000, 0x1FFF);
         }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<pitchbend_message_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -424,8 +889,8 @@ namespace cppmidi {
     public:
         virtual ~meta_midi_event() = default;
     protected:
-        meta_midi_event(uint32_t ticks)
-            : midi_event(ticks) {}
+        meta_midi_event(uint32_t ticks, event_kind kind)
+            : midi_event(ticks, kind) {}
     };
 
     //=====
@@ -433,12 +898,15 @@ namespace cppmidi {
     class sequencenumber_meta_midi_event : public meta_midi_event {
     public:
         sequencenumber_meta_midi_event(uint32_t ticks, uint16_t seq_num)
-            : meta_midi_event(ticks), seq_num(seq_num), empty(false) {}
+            : meta_midi_event(ticks, event_kind::SequenceNumber), seq_num(seq_num), empty(false) {}
         sequencenumber_meta_midi_event(uint32_t ticks)
-            : meta_midi_event(ticks), seq_num(0), empty(true) {}
+            : meta_midi_event(ticks, event_kind::SequenceNumber), seq_num(0), empty(true) {}
         std::vector<uint8_t> event_data() const override;
         uint16_t get_seq_num() const { return seq_num; }
         bool get_empty() const { return empty; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<sequencenumber_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -449,11 +917,14 @@ namespace cppmidi {
     class text_meta_midi_event : public meta_midi_event {
     public:
         text_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Text), text(text) {}
         text_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Text), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<text_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -463,11 +934,14 @@ namespace cppmidi {
     class copyright_meta_midi_event : public meta_midi_event {
     public:
         copyright_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Copyright), text(text) {}
         copyright_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Copyright), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<copyright_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -477,11 +951,14 @@ namespace cppmidi {
     class trackname_meta_midi_event : public meta_midi_event {
     public:
         trackname_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::TrackName), text(text) {}
         trackname_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::TrackName), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<trackname_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -491,11 +968,14 @@ namespace cppmidi {
     class instrument_meta_midi_event : public meta_midi_event {
     public:
         instrument_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Instrument), text(text) {}
         instrument_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Instrument), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<instrument_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -505,11 +985,14 @@ namespace cppmidi {
     class lyric_meta_midi_event : public meta_midi_event {
     public:
         lyric_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Lyric), text(text) {}
         lyric_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Lyric), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<lyric_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -519,11 +1002,14 @@ namespace cppmidi {
     class marker_meta_midi_event : public meta_midi_event {
     public:
         marker_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Marker), text(text) {}
         marker_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::Marker), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<marker_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -533,11 +1019,14 @@ namespace cppmidi {
     class cuepoint_meta_midi_event : public meta_midi_event {
     public:
         cuepoint_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::CuePoint), text(text) {}
         cuepoint_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::CuePoint), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<cuepoint_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -547,11 +1036,14 @@ namespace cppmidi {
     class programname_meta_midi_event : public meta_midi_event {
     public:
         programname_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::ProgramName), text(text) {}
         programname_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::ProgramName), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<programname_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -561,11 +1053,14 @@ namespace cppmidi {
     class devicename_meta_midi_event : public meta_midi_event {
     public:
         devicename_meta_midi_event(uint32_t ticks, const std::string& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::DeviceName), text(text) {}
         devicename_meta_midi_event(uint32_t ticks, std::string&& text)
-            : meta_midi_event(ticks), text(text) {}
+            : meta_midi_event(ticks, event_kind::DeviceName), text(text) {}
         std::vector<uint8_t> event_data() const override;
         const std::string& get_text() const { return text; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<devicename_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -575,9 +1070,12 @@ namespace cppmidi {
     class channelprefix_meta_midi_event : public meta_midi_event {
     public:
         channelprefix_meta_midi_event(uint32_t ticks, uint8_t channel)
-            : meta_midi_event(ticks), channel(channel & 0xF) {}
+            : meta_midi_event(ticks, event_kind::ChannelPrefix), channel(channel & 0xF) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_channel() const { return channel; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<channelprefix_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -587,9 +1085,12 @@ namespace cppmidi {
     class midiport_meta_midi_event : public meta_midi_event {
     public:
         midiport_meta_midi_event(uint32_t ticks, uint8_t port)
-            : meta_midi_event(ticks), port(port & 0x7F) {}
+            : meta_midi_event(ticks, event_kind::MidiPort), port(port & 0x7F) {}
         std::vector<uint8_t> event_data() const override;
         uint8_t get_port() const { return port; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<midiport_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -599,8 +1100,11 @@ namespace cppmidi {
     class endoftrack_meta_midi_event : public meta_midi_event {
     public:
         endoftrack_meta_midi_event(uint32_t ticks)
-            : meta_midi_event(ticks) {}
+            : meta_midi_event(ticks, event_kind::EndOfTrack) {}
         std::vector<uint8_t> event_data() const override;
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<endoftrack_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     };
@@ -608,15 +1112,18 @@ namespace cppmidi {
     class tempo_meta_midi_event : public meta_midi_event {
     public:
         tempo_meta_midi_event(uint32_t ticks, uint32_t us_per_beat)
-            : meta_midi_event(ticks), us_per_beat(us_per_beat) {}
+            : meta_midi_event(ticks, event_kind::Tempo), us_per_beat(us_per_beat) {}
         tempo_meta_midi_event(uint32_t ticks, double bpm)
-            : meta_midi_event(ticks),
+            : meta_midi_event(ticks, event_kind::Tempo),
             us_per_beat(static_cast<uint32_t>(1000000.0 * 60.0 / bpm)) {
                 errchk();
             }
         std::vector<uint8_t> event_data() const override;
         uint32_t get_us_per_beat() const { return us_per_beat; }
         double get_bpm() const { return 1000000.0 * 60.0 / us_per_beat; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<tempo_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -629,7 +1136,7 @@ namespace cppmidi {
         smpteoffset_meta_midi_event(uint32_t ticks, uint8_t frame_rate,
                 uint8_t hour, uint8_t minute, uint8_t second,
                 uint8_t frames, uint8_t frame_fractions)
-            : meta_midi_event(ticks), frame_rate(frame_rate),
+            : meta_midi_event(ticks, event_kind::SmpteOffset), frame_rate(frame_rate),
             hour(hour), minute(minute), second(second),
             frames(frames), frame_fractions(frame_fractions) {
                 errchk();
@@ -641,6 +1148,9 @@ namespace cppmidi {
         uint8_t get_second() const { return second; }
         uint8_t get_frames() const { return frames; }
         uint8_t get_frame_fractions() const { return frame_fractions; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<smpteoffset_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -655,7 +1165,7 @@ namespace cppmidi {
         timesignature_meta_midi_event(uint32_t ticks,
                 uint8_t numerator, uint8_t denominator,
                 uint8_t tick_clocks, uint8_t n32n)
-            : meta_midi_event(ticks),
+            : meta_midi_event(ticks, event_kind::TimeSignature),
             numerator(numerator), denominator(denominator),
             tick_clocks(tick_clocks), n32n(n32n) {}
         std::vector<uint8_t> event_data() const override;
@@ -663,6 +1173,9 @@ namespace cppmidi {
         uint8_t get_denominator() const { return denominator; }
         uint8_t get_tick_clocks() const { return tick_clocks; }
         uint8_t get_n32n() const { return n32n; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<timesignature_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -674,12 +1187,15 @@ namespace cppmidi {
     public:
         keysignature_meta_midi_event(uint32_t ticks, int8_t sharp_flats,
                 bool _minor)
-            : meta_midi_event(ticks), sharp_flats(sharp_flats), _minor(_minor) {
+            : meta_midi_event(ticks, event_kind::KeySignature), sharp_flats(sharp_flats), _minor(_minor) {
                 errchk();
             }
         std::vector<uint8_t> event_data() const override;
         int8_t get_sharp_flats() const { return sharp_flats; }
         bool get_minor() const { return _minor; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<keysignature_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -692,12 +1208,15 @@ namespace cppmidi {
     public:
         sequencerspecific_meta_midi_event(uint32_t ticks,
                 const std::vector<uint8_t>& data)
-            : meta_midi_event(ticks), data(data) {}
+            : meta_midi_event(ticks, event_kind::SequencerSpecific), data(data) {}
         sequencerspecific_meta_midi_event(uint32_t ticks,
                 std::vector<uint8_t>&& data)
-            : meta_midi_event(ticks), data(data) {}
+            : meta_midi_event(ticks, event_kind::SequencerSpecific), data(data) {}
         std::vector<uint8_t> event_data() const override;
         const std::vector<uint8_t>& get_data() const { return data; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<sequencerspecific_meta_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -710,13 +1229,16 @@ namespace cppmidi {
     public:
         sysex_midi_event(uint32_t ticks, const std::vector<uint8_t>& data,
                 bool first_chunk)
-            : midi_event(ticks), data(data), first_chunk(first_chunk) {}
+            : midi_event(ticks, event_kind::SysEx), data(data), first_chunk(first_chunk) {}
         sysex_midi_event(uint32_t ticks, std::vector<uint8_t>&& data,
                 bool first_chunk)
-            : midi_event(ticks), data(data), first_chunk(first_chunk) {}
+            : midi_event(ticks, event_kind::SysEx), data(data), first_chunk(first_chunk) {}
         std::vector<uint8_t> event_data() const override;
         const std::vector<uint8_t>& get_data() const { return data; }
         bool get_first_chunk() const { return first_chunk; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<sysex_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
@@ -727,17 +1249,908 @@ namespace cppmidi {
     class escape_midi_event : public midi_event {
     public:
         escape_midi_event(uint32_t ticks, const std::vector<uint8_t>& data)
-            : midi_event(ticks), data(data) {}
+            : midi_event(ticks, event_kind::Escape), data(data) {}
         escape_midi_event(uint32_t ticks, std::vector<uint8_t>&& data)
-            : midi_event(ticks), data(data) {}
+            : midi_event(ticks, event_kind::Escape), data(data) {}
         std::vector<uint8_t> event_data() const override;
         const std::vector<uint8_t>& get_data() const { return data; }
+        std::unique_ptr<midi_event> clone() const override {
+            return std::make_unique<escape_midi_event>(*this);
+        }
         void accept(visitor& v) override { v.visit(*this); }
         void print(std::ostream& os, const std::string& indent) const override;
     private:
         std::vector<uint8_t> data;
     };
 
+    //=========================================================================
+
+    // concrete event class of an event kind
+    template<event_kind K> struct event_type;
+    template<> struct event_type<event_kind::Dummy> { using type = dummy_midi_event; };
+    template<> struct event_type<event_kind::NoteOff> { using type = noteoff_message_midi_event; };
+    template<> struct event_type<event_kind::NoteOn> { using type = noteon_message_midi_event; };
+    template<> struct event_type<event_kind::NoteAftertouch> { using type = noteaftertouch_message_midi_event; };
+    template<> struct event_type<event_kind::Controller> { using type = controller_message_midi_event; };
+    template<> struct event_type<event_kind::Program> { using type = program_message_midi_event; };
+    template<> struct event_type<event_kind::ChannelAftertouch> { using type = channelaftertouch_message_midi_event; };
+    template<> struct event_type<event_kind::PitchBend> { using type = pitchbend_message_midi_event; };
+    template<> struct event_type<event_kind::SequenceNumber> { using type = sequencenumber_meta_midi_event; };
+    template<> struct event_type<event_kind::Text> { using type = text_meta_midi_event; };
+    template<> struct event_type<event_kind::Copyright> { using type = copyright_meta_midi_event; };
+    template<> struct event_type<event_kind::TrackName> { using type = trackname_meta_midi_event; };
+    template<> struct event_type<event_kind::Instrument> { using type = instrument_meta_midi_event; };
+    template<> struct event_type<event_kind::Lyric> { using type = lyric_meta_midi_event; };
+    template<> struct event_type<event_kind::Marker> { using type = marker_meta_midi_event; };
+    template<> struct event_type<event_kind::CuePoint> { using type = cuepoint_meta_midi_event; };
+    template<> struct event_type<event_kind::ProgramName> { using type = programname_meta_midi_event; };
+    template<> struct event_type<event_kind::DeviceName> { using type = devicename_meta_midi_event; };
+    template<> struct event_type<event_kind::ChannelPrefix> { using type = channelprefix_meta_midi_event; };
+    template<> struct event_type<event_kind::MidiPort> { using type = midiport_meta_midi_event; };
+    template<> struct event_type<event_kind::EndOfTrack> { using type = endoftrack_meta_midi_event; };
+    template<> struct event_type<event_kind::Tempo> { using type = tempo_meta_midi_event; };
+    template<> struct event_type<event_kind::SmpteOffset> { using type = smpteoffset_meta_midi_event; };
+    template<> struct event_type<event_kind::TimeSignature> { using type = timesignature_meta_midi_event; };
+    template<> struct event_type<event_kind::KeySignature> { using type = keysignature_meta_midi_event; };
+    template<> struct event_type<event_kind::SequencerSpecific> { using type = sequencerspecific_meta_midi_event; };
+    template<> struct event_type<event_kind::SysEx> { using type = sysex_midi_event; };
+    template<> struct event_type<event_kind::Escape> { using type = escape_midi_event; };
+
+    // Builds an overload set from lambdas, e.g. for visit_events:
+    //   overloaded{[](noteon_message_midi_event& ev) {...}, [](tempo_meta_midi_event& ev) {...}}
+    template<typename... Fs>
+    struct overloaded : Fs... {
+        using Fs::operator()...;
+    };
+    template<typename... Fs> overloaded(Fs...) -> overloaded<Fs...>;
+
+    namespace detail {
+        template<event_kind K, typename Event, typename F>
+        inline void dispatch_kind(Event& ev, F& f) {
+            using T = std::conditional_t<std::is_const_v<Event>,
+                  const typename event_type<K>::type, typename event_type<K>::type>;
+            if constexpr (std::is_invocable_v<F&, T&>)
+                f(static_cast<T&>(ev));
+        }
+    }
+
+    // Calls f with ev cast to its concrete class. Unlike visitor, this is a
+    // switch on kind() instead of two virtual calls, so f can be inlined,
+    // and kinds f can't be called with are skipped without any call.
+    // Event is midi_event or const midi_event.
+    template<typename Event, typename F>
+    inline void dispatch_event(Event& ev, F&& f) {
+        switch (ev.kind()) {
+#define CPPMIDI_DISPATCH_KIND(kind) \
+        case event_kind::kind: detail::dispatch_kind<event_kind::kind>(ev, f); break;
+        CPPMIDI_DISPATCH_KIND(Dummy)
+        CPPMIDI_DISPATCH_KIND(NoteOff)
+        CPPMIDI_DISPATCH_KIND(NoteOn)
+        CPPMIDI_DISPATCH_KIND(NoteAftertouch)
+        CPPMIDI_DISPATCH_KIND(Controller)
+        CPPMIDI_DISPATCH_KIND(Program)
+        CPPMIDI_DISPATCH_KIND(ChannelAftertouch)
+        CPPMIDI_DISPATCH_KIND(PitchBend)
+        CPPMIDI_DISPATCH_KIND(SequenceNumber)
+        CPPMIDI_DISPATCH_KIND(Text)
+        CPPMIDI_DISPATCH_KIND(Copyright)
+        CPPMIDI_DISPATCH_KIND(TrackName)
+        CPPMIDI_DISPATCH_KIND(Instrument)
+        CPPMIDI_DISPATCH_KIND(Lyric)
+        CPPMIDI_DISPATCH_KIND(Marker)
+        CPPMIDI_DISPATCH_KIND(CuePoint)
+        CPPMIDI_DISPATCH_KIND(ProgramName)
+        CPPMIDI_DISPATCH_KIND(DeviceName)
+        CPPMIDI_DISPATCH_KIND(ChannelPrefix)
+        CPPMIDI_DISPATCH_KIND(MidiPort)
+        CPPMIDI_DISPATCH_KIND(EndOfTrack)
+        CPPMIDI_DISPATCH_KIND(Tempo)
+        CPPMIDI_DISPATCH_KIND(SmpteOffset)
+        CPPMIDI_DISPATCH_KIND(TimeSignature)
+        CPPMIDI_DISPATCH_KIND(KeySignature)
+        CPPMIDI_DISPATCH_KIND(SequencerSpecific)
+        CPPMIDI_DISPATCH_KIND(SysEx)
+        CPPMIDI_DISPATCH_KIND(Escape)
+#undef CPPMIDI_DISPATCH_KIND
+        }
+    }
+
+    namespace detail {
+        template<typename Event, typename F, size_t... K>
+        constexpr kind_mask accepted_kinds(std::index_sequence<K...>) {
+            return ((std::is_invocable_v<F&, std::conditional_t<std::is_const_v<Event>,
+                        const typename event_type<static_cast<event_kind>(K)>::type,
+                        typename event_type<static_cast<event_kind>(K)>::type>&> ?
+                        kind_bit(static_cast<event_kind>(K)) : kind_mask(0)) | ...);
+        }
+    }
+
+    // the kinds dispatch_event(Event&, F) calls F for
+    template<typename Event, typename F>
+    constexpr kind_mask accepted_kinds =
+        detail::accepted_kinds<Event, F>(std::make_index_sequence<num_event_kinds>());
+
+    // Calls f for every event f accepts, see dispatch_event. f may be a
+    // generic lambda or an overloaded set handling only some classes. If f
+    // doesn't accept all kinds, only the matching events are looked at using
+    // the kind index of the track. The non-const versions count as
+    // modification, see midi_track::touch_contents().
+    template<typename F>
+    void visit_events(midi_track& mtrk, F&& f) {
+        mtrk.touch_contents();
+        constexpr kind_mask mask = accepted_kinds<midi_event, std::remove_reference_t<F>>;
+        if constexpr (mask == all_kinds) {
+            for (auto& ev : mtrk.midi_events)
+                dispatch_event(*ev, f);
+        } else {
+            mtrk.for_each_of_kinds(mask, [&](size_t pos) {
+                dispatch_event(*mtrk.midi_events[pos], f);
+            });
+        }
+    }
+    template<typename F>
+    void visit_events(const midi_track& mtrk, F&& f) {
+        constexpr kind_mask mask = accepted_kinds<const midi_event, std::remove_reference_t<F>>;
+        if constexpr (mask == all_kinds) {
+            for (const auto& ev : mtrk.midi_events)
+                dispatch_event(static_cast<const midi_event&>(*ev), f);
+        } else {
+            mtrk.for_each_of_kinds(mask, [&](size_t pos) {
+                dispatch_event(static_cast<const midi_event&>(*mtrk.midi_events[pos]), f);
+            });
+        }
+    }
+    template<typename F>
+    void visit_events(midi_file& mf, F&& f) {
+        for (midi_track& mtrk : mf.midi_tracks)
+            visit_events(mtrk, f);
+    }
+    template<typename F>
+    void visit_events(const midi_file& mf, F&& f) {
+        for (const midi_track& mtrk : mf.midi_tracks)
+            visit_events(mtrk, f);
+    }
+
+    //=========================================================================
+
+    // Applies a sequence of filter, map and insert stages to the events of a
+    // track in a single pass. Every event goes through the stages in order,
+    // events inserted by a stage go through the stages after it. The event
+    // list is rebuilt once at the end and sorted again only if stages moved
+    // events out of order.
+    //
+    // Stage callbacks take either any event (const midi_event& / midi_event&)
+    // or specific event classes, like visit_events. Events of other classes
+    // pass such stages untouched.
+    //
+    // If a stage throws, the events of the track stay in place (changes made
+    // by map stages before are kept).
+    class event_pipeline {
+    public:
+        struct stage_stats {
+            std::string name;
+            size_t seen = 0;
+            size_t dropped = 0;
+            size_t modified = 0;
+            size_t inserted = 0;
+        };
+
+        // keeps the events pred returns true for
+        template<typename F>
+        event_pipeline& filter(F pred, std::string name = "filter") {
+            if constexpr (std::is_invocable_r_v<bool, F&, const midi_event&>) {
+                add_stage(stage_type::Filter, std::move(name),
+                        [pred](midi_event& ev) mutable { return !pred(static_cast<const midi_event&>(ev)); });
+            } else {
+                add_stage(stage_type::Filter, std::move(name), [pred](midi_event& ev) mutable {
+                    bool keep = true;
+                    dispatch_event(static_cast<const midi_event&>(ev),
+                            [&](const auto& e) -> decltype(void(pred(e))) { keep = pred(e); });
+                    return !keep;
+                });
+            }
+            return *this;
+        }
+
+        // Modifies events in place. Returning false counts the event as not
+        // modified, callbacks returning void always count as modification.
+        template<typename F>
+        event_pipeline& map(F f, std::string name = "map") {
+            if constexpr (std::is_invocable_r_v<bool, F&, midi_event&>) {
+                add_stage(stage_type::Map, std::move(name), [f](midi_event& ev) mutable { return f(ev); });
+            } else {
+                add_stage(stage_type::Map, std::move(name), [f](midi_event& ev) mutable {
+                    bool modified = false;
+                    dispatch_event(ev, [&](auto& e) -> decltype(void(f(e))) {
+                        if constexpr (std::is_same_v<decltype(f(e)), bool>) {
+                            modified = f(e);
+                        } else {
+                            f(e);
+                            modified = true;
+                        }
+                    });
+                    return modified;
+                });
+            }
+            return *this;
+        }
+
+        // f(event, out) may add new events to out, which are placed after the
+        // event (and sorted by ticks at the end if necessary)
+        event_pipeline& insert(std::function<void(const midi_event&,
+                    std::vector<std::unique_ptr<midi_event>>&)> f, std::string name = "insert");
+
+        // let run(midi_file&) remove tracks without events (except end of track)
+        event_pipeline& drop_empty_tracks(bool drop = true) {
+            drop_empty = drop;
+            return *this;
+        }
+
+        // Lets run(midi_file&) process large files on several threads. The
+        // same stage callbacks are then called concurrently, so they must be
+        // thread safe (e.g. no unsynchronized captured state).
+        event_pipeline& parallel_tracks(bool enable = true) {
+            parallel = enable;
+            return *this;
+        }
+
+        void run(midi_track& mtrk);
+        // tracks are processed in order, or in parallel, see parallel_tracks()
+        void run(midi_file& mf);
+
+        // counters accumulate over all runs
+        const std::vector<stage_stats>& get_stats() const { return stats; }
+        void reset_stats();
+    private:
+        enum class stage_type {
+            Filter, Map, Insert
+        };
+        struct stage {
+            stage_type type;
+            // Filter: returns true to drop, Map: returns true if modified
+            std::function<bool(midi_event&)> apply;
+            std::function<void(const midi_event&, std::vector<std::unique_ptr<midi_event>>&)> insert;
+        };
+
+        void add_stage(stage_type type, std::string name, std::function<bool(midi_event&)> apply);
+        // an event of the track or one inserted by a stage
+        struct event_ref {
+            bool inserted;
+            size_t index;
+        };
+        struct track_run {
+            midi_track& mtrk;
+            std::vector<std::unique_ptr<midi_event>> inserted;
+            std::vector<event_ref> out;
+            std::vector<stage_stats> stats;
+        };
+
+        void process(event_ref ref, size_t first_stage, track_run& tr) const;
+        std::vector<stage_stats> run_track(midi_track& mtrk) const;
+        void add_stats(const std::vector<stage_stats>& track_stats);
+
+        std::vector<stage> stages;
+        std::vector<stage_stats> stats;
+        bool drop_empty = false;
+        bool parallel = false;
+    };
+
+    //=========================================================================
+
+    // A complete SysEx message, the payload after the 0xF0 status byte
+    // including the terminating 0xF7
+    struct sysex_message {
+        // ticks of the first packet
+        uint32_t ticks;
+        // positions of the first and last packet in the track
+        size_t first_index;
+        size_t last_index;
+        const uint8_t *data;
+        size_t size;
+        // false if the track ends before the terminating 0xF7
+        bool complete;
+    };
+
+    // Collects the SysEx messages of a track. Messages sent in a single
+    // event are views of the event data, messages split into packets are
+    // concatenated once into a buffer owned by the reassembler. The track
+    // must not be modified while the messages are used. Continuation packets
+    // without a first packet are skipped.
+    class sysex_reassembler {
+    public:
+        explicit sysex_reassembler(const midi_track& mtrk);
+
+        const std::vector<sysex_message>& get_messages() const { return messages; }
+        size_t size() const { return messages.size(); }
+        const sysex_message& operator[](size_t i) const { return messages[i]; }
+        auto begin() const { return messages.begin(); }
+        auto end() const { return messages.end(); }
+    private:
+        std::vector<sysex_message> messages;
+        std::vector<uint8_t> buffer;
+    };
+
+    // Splits a SysEx payload (without 0xF0, 0xF7 is added if missing) into
+    // packets of at most max_packet_size bytes, the first one at ticks and
+    // the following ones packet_interval ticks apart.
+    std::vector<std::unique_ptr<midi_event>> split_sysex(uint32_t ticks,
+            const uint8_t *data, size_t size, size_t max_packet_size,
+            uint32_t packet_interval = 0);
+
+    //=========================================================================
+
+    struct merged_event {
+        size_t track;
+        size_t index;
+        const midi_event *event;
+    };
+
+    // Iterates over the events of all tracks of a file in time order, without
+    // copying them. The stream performs a k-way merge of the (sorted) tracks
+    // using a heap of one cursor per track, i.e. O(k) extra memory. Events on
+    // equal ticks are ordered by track index, which matches a stable sort of
+    // the concatenated tracks. The file must not be modified during iteration.
+    class merged_event_stream {
+    public:
+        // starting at a tick other than 0 uses midi_track::lower_bound()
+        explicit merged_event_stream(const midi_file& mf, uint32_t start_ticks = 0);
+
+        bool empty() const { return heap.empty(); }
+        // the next event, stream must not be empty
+        merged_event front() const {
+            const cursor& cur = heap.front();
+            return merged_event{cur.track, cur.index,
+                mf.midi_tracks[cur.track].midi_events[cur.index].get()};
+        }
+        void pop();
+
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = merged_event;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const merged_event *;
+            using reference = merged_event;
+
+            explicit iterator(merged_event_stream *stream) : stream(stream) {}
+            merged_event operator*() const { return stream->front(); }
+            iterator& operator++() { stream->pop(); return *this; }
+            bool operator==(const iterator& rhs) const { return at_end() == rhs.at_end(); }
+            bool operator!=(const iterator& rhs) const { return !(*this == rhs); }
+        private:
+            bool at_end() const { return stream == nullptr || stream->empty(); }
+            merged_event_stream *stream;
+        };
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(nullptr); }
+    private:
+        struct cursor {
+            uint32_t ticks;
+            size_t track;
+            size_t index;
+            // heap order: the smallest (ticks, track) is at the front
+            bool operator<(const cursor& rhs) const {
+                if (ticks != rhs.ticks)
+                    return ticks > rhs.ticks;
+                return track > rhs.track;
+            }
+        };
+        void push(size_t track, size_t index);
+
+        const midi_file& mf;
+        std::vector<cursor> heap;
+    };
+
+    //=========================================================================
+
+    // Converts between ticks and microseconds. The map is built once from all
+    // tempo events of a file; the tempo defaults to 120 BPM until the first one.
+    // Conversions use exact integer math, so results don't drift on long files.
+    class tempo_map {
+    public:
+        struct segment {
+            uint32_t ticks;
+            uint32_t us_per_beat;
+            // time at the start of the segment in microseconds * time division
+            uint64_t scaled_us;
+        };
+
+        explicit tempo_map(const midi_file& mf);
+
+        // O(log n) in the number of tempo changes
+        uint64_t ticks_to_us(uint32_t ticks) const;
+        // returns the last tick for which ticks_to_us() is not after us
+        uint32_t us_to_ticks(uint64_t us) const;
+        uint32_t us_per_beat_at(uint32_t ticks) const {
+            return segments[find_segment(ticks)].us_per_beat;
+        }
+
+        // Batch conversion of whole arrays. Ascending input (e.g. the event
+        // ticks of a track) is converted without any searching.
+        void ticks_to_us(const uint32_t *ticks, uint64_t *us, size_t count) const;
+        void us_to_ticks(const uint64_t *us, uint32_t *ticks, size_t count) const;
+
+        uint16_t get_time_division() const { return time_division; }
+        const std::vector<segment>& get_segments() const { return segments; }
+    private:
+        size_t find_segment(uint32_t ticks) const;
+        size_t find_segment_scaled(uint64_t scaled_us) const;
+
+        uint16_t time_division;
+        std::vector<segment> segments;
+    };
+
+    //=========================================================================
+
+    // Controller, program and pitch bend state of a single channel
+    struct channel_state {
+        channel_state();
+
+        void set_controller(uint8_t controller, uint8_t value);
+        void set_program(uint8_t program);
+        void set_pitch_bend(int16_t pitch);
+        // appends the events which restore this state on a reset synth
+        void append_events(midi_track& mtrk, uint32_t ticks, uint8_t channel) const;
+
+        // controllers hold their power on defaults until they're set,
+        // the RPN/NRPN selection is kept in the controllers as well
+        std::array<uint8_t, 128> controllers;
+        std::bitset<128> controllers_set;
+        uint8_t program;
+        bool program_set;
+        int16_t pitch_bend;
+        // set via RPN 0
+        uint8_t bend_range_semitones;
+        uint8_t bend_range_cents;
+        bool bend_range_set;
+        // whether the last parameter selection was an NRPN or an RPN
+        bool nrpn_selected;
+    };
+
+    // Answers which controller, program and pitch bend state the channels are
+    // in at a given tick. A full state is checkpointed every
+    // checkpoint_interval state changes, so a query is a binary search plus
+    // the replay of less than checkpoint_interval changes.
+    class state_chaser {
+    public:
+        explicit state_chaser(const midi_file& mf, size_t checkpoint_interval = 256);
+
+        // state after all events before ticks, events at ticks are not applied
+        std::array<channel_state, 16> state_at(uint32_t ticks) const;
+        channel_state state_at(uint32_t ticks, uint8_t channel) const;
+        size_t num_changes() const { return changes.size(); }
+    private:
+        struct state_change {
+            uint32_t ticks;
+            uint8_t channel;
+            event_kind kind;
+            uint8_t controller;
+            uint8_t value;
+            int16_t pitch;
+        };
+
+        size_t replay_start(uint32_t ticks, size_t& end) const;
+        static void apply(channel_state& state, const state_change& change);
+
+        size_t checkpoint_interval;
+        std::vector<state_change> changes;
+        // checkpoints[k] is the state before changes[k * checkpoint_interval]
+        std::vector<std::array<channel_state, 16>> checkpoints;
+    };
+
+    //=========================================================================
+
+    // Plays a file by passing the wire bytes of its events to a sink at the
+    // right time. Meta events are not sent. Timestamps passed to the sink are
+    // the output time in microseconds since playback started; it keeps
+    // running across seeks and loops. Every event is scheduled by an absolute
+    // deadline derived from the tempo map, so timing errors don't accumulate.
+    //
+    // The file must not be modified while a player exists. The sink is called
+    // with an internal lock held and must not call back into the player.
+    class midi_player {
+    public:
+        using sink = std::function<void(uint64_t time_us, const uint8_t *data, size_t size)>;
+
+        midi_player(const midi_file& mf, sink output);
+        midi_player(const midi_player&) = delete;
+        midi_player& operator=(const midi_player&) = delete;
+        ~midi_player();
+
+        // start() plays in real time on a background thread
+        void start();
+        void stop();
+        bool is_playing() const;
+
+        // seeking, looping and stopping send All Notes Off to channels
+        // with possibly sounding notes, seeking and looping then send the
+        // controller, program and pitch bend state at the new position
+        void seek(uint32_t ticks);
+        uint32_t get_position() const;
+        void set_loop(uint32_t begin_ticks, uint32_t end_ticks);
+        void clear_loop();
+        // 2.0 plays twice as fast
+        void set_tempo_scale(double scale);
+
+        // Delivers all events due until the given output time without waiting.
+        // This is what the playback thread does; call it directly to render
+        // a file offline (e.g. into a file or memory sink).
+        void render(uint64_t until_us);
+        uint64_t get_time() const;
+        // true if the end has been reached (never while looping)
+        bool finished() const;
+    private:
+        // the output time right now, the real clock while playing
+        uint64_t now_locked() const;
+        void reanchor(uint64_t time_us);
+        uint64_t deadline(uint32_t ticks) const;
+        bool next_deadline(uint64_t& time_us, bool& wrap) const;
+        void render_locked(uint64_t until_us);
+        void notes_off(uint64_t time_us);
+        void chase(uint64_t time_us, uint32_t ticks);
+        void run();
+
+        const midi_file& mf;
+        tempo_map tempo;
+        state_chaser chaser;
+        sink output;
+        std::optional<merged_event_stream> stream;
+
+        // output time and musical time (tempo_map microseconds) of the last
+        // seek or tempo change, deadlines are computed relative to these
+        uint64_t anchor_time_us;
+        uint64_t anchor_music_us;
+        uint64_t current_time_us;
+        double tempo_scale;
+        bool looping;
+        uint32_t loop_begin, loop_end;
+        uint16_t sounding_channels;
+
+        mutable std::mutex mtx;
+        std::condition_variable wakeup;
+        std::thread thread;
+        bool playing;
+        bool stop_requested;
+        std::chrono::steady_clock::time_point clock_origin;
+    };
+
+    //=========================================================================
+
+    // Maps a whole file into memory. On platforms without mmap the file is
+    // read into a buffer instead (and written back by sync() if writable).
+    class mapped_file {
+    public:
+        mapped_file(const std::filesystem::path& file_path, bool writable = false);
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+        mapped_file(mapped_file&& other) noexcept;
+        mapped_file& operator=(mapped_file&& other) noexcept;
+        ~mapped_file();
+
+        uint8_t *data() { return map_data; }
+        const uint8_t *data() const { return map_data; }
+        size_t size() const { return map_size; }
+        bool is_writable() const { return writable; }
+
+        // writes modifications back to the file
+        void sync();
+    private:
+        void unmap() noexcept;
+
+        uint8_t *map_data = nullptr;
+        size_t map_size = 0;
+        bool writable = false;
+        std::filesystem::path file_path;
+        std::vector<uint8_t> fallback_buffer;
+    };
+
+    //=========================================================================
+
+    // Binary snapshot of a decoded midi_file. All values are stored in host
+    // byte order, a snapshot is only meant to be loaded on the machine type
+    // it was created on. Layout:
+    //
+    //   snapshot_header
+    //   uint64_t track_offsets[num_tracks + 1]   (index of first event of track)
+    //   snapshot_event events[num_events]
+    //   uint8_t heap[heap_size]                  (text and binary payloads)
+    //
+    // content_hash is the FNV-1a hash of everything following the header.
+    struct snapshot_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint16_t time_division;
+        uint16_t reserved0;
+        uint32_t num_tracks;
+        uint64_t num_events;
+        uint64_t heap_size;
+        uint64_t content_hash;
+        uint64_t reserved1;
+    };
+
+    // Fixed size record of one event. The meaning of a, b, c and value
+    // depends on kind:
+    //
+    //   channel messages:  a = channel, b, c = data bytes,
+    //                      value = pitch (int16_t) for pitch bends
+    //   SequenceNumber:    value = seq_num, b = empty
+    //   ChannelPrefix:     a = channel
+    //   MidiPort:          a = port
+    //   Tempo:             value = us_per_beat
+    //   SmpteOffset:       a = frame_rate, b = hour, c = minute,
+    //                      value = second | frames << 8 | frame_fractions << 16
+    //   TimeSignature:     a = numerator, b = denominator, c = tick_clocks, value = n32n
+    //   KeySignature:      a = sharp_flats (int8_t), b = minor
+    //   text meta events, SequencerSpecific, SysEx and Escape:
+    //                      value = heap offset, size = payload size,
+    //                      b = first_chunk (SysEx only)
+    struct snapshot_event {
+        uint32_t ticks;
+        event_kind kind;
+        uint8_t a, b, c;
+        uint32_t value;
+        uint32_t size;
+    };
+
+    // Read-only view of a snapshot file. Loading maps the file and validates
+    // the header and track table, no work is done per event. Hashing the whole
+    // content is opt-in (verify_hash) as it touches every page of the mapping.
+    class midi_snapshot {
+    public:
+        static constexpr uint32_t format_version = 1;
+
+        explicit midi_snapshot(const std::filesystem::path& file_path,
+                bool verify_hash = false);
+
+        uint16_t time_division() const { return header().time_division; }
+        uint64_t content_hash() const { return header().content_hash; }
+        size_t num_tracks() const { return header().num_tracks; }
+        size_t num_events() const { return static_cast<size_t>(header().num_events); }
+
+        const snapshot_event *track_begin(size_t trk) const {
+            return events + track_offsets[trk];
+        }
+        const snapshot_event *track_end(size_t trk) const {
+            return events + track_offsets[trk + 1];
+        }
+        const uint8_t *payload(const snapshot_event& ev) const {
+            return heap + ev.value;
+        }
+
+        // decodes a single record into an event object
+        std::unique_ptr<midi_event> make_event(const snapshot_event& ev) const;
+        midi_file to_midi_file() const;
+
+        static void save(const midi_file& mf, const std::filesystem::path& file_path);
+    private:
+        const snapshot_header& header() const {
+            return *reinterpret_cast<const snapshot_header *>(mapping.data());
+        }
+
+        mapped_file mapping;
+        const uint64_t *track_offsets;
+        const snapshot_event *events;
+        const uint8_t *heap;
+    };
+
+    //=========================================================================
+
+    // One event inside raw MIDI file data, as decoded by raw_track_decoder.
+    // Data bytes point into the raw data and may be modified in place, as
+    // long as the encoded size of the event stays the same.
+    struct raw_event {
+        uint32_t ticks;
+        size_t track;
+        // effective status byte, also if the event uses running status.
+        // 0xFF for meta events, 0xF0/0xF7 for sysex and escape events.
+        uint8_t status;
+        // points to the status byte in the data, nullptr for running status.
+        // Modifying it also affects following events which use running status.
+        uint8_t *status_ptr;
+        uint8_t meta_type;
+        // channel messages: the 1 or 2 data bytes, otherwise: the payload
+        uint8_t *data;
+        size_t size;
+
+        bool is_channel_message() const { return status < 0xF0; }
+        uint8_t channel() const { return static_cast<uint8_t>(status & 0xF); }
+        uint8_t message_type() const { return static_cast<uint8_t>(status >> 4); }
+    };
+
+    // Lazily decodes the events of a single MTrk chunk
+    class raw_track_decoder {
+    public:
+        raw_track_decoder(uint8_t *track_begin, uint8_t *track_end, size_t track);
+        // returns false after the end of track event
+        bool next(raw_event& ev);
+    private:
+        uint8_t *pos;
+        uint8_t *end;
+        size_t track;
+        uint32_t current_tick;
+        uint8_t running_status;
+        bool done;
+    };
+
+    // Non-owning view of the raw bytes of a MIDI file. Only the header and
+    // the chunk table are parsed on construction, events are decoded on
+    // demand without allocating. Data which is not writable (e.g. a read-only
+    // mapping) must only be read.
+    class raw_midi_data {
+    public:
+        raw_midi_data(uint8_t *data, size_t size, bool writable = true);
+
+        uint16_t get_midi_type() const { return midi_type; }
+        uint16_t get_time_division() const { return time_division; }
+        size_t num_tracks() const { return tracks.size(); }
+        bool is_writable() const { return writable; }
+        raw_track_decoder decoder(size_t trk) const {
+            return raw_track_decoder(tracks.at(trk).first, tracks.at(trk).second, trk);
+        }
+
+        // decodes all tracks once, throws on the first malformed one
+        void validate() const;
+
+        // Reads all events. Tracks are decoded while iterating, so a malformed
+        // track throws after f has seen the events of the tracks before it.
+        template<typename F>
+        void for_each_event(F&& f) const {
+            raw_event ev;
+            for (size_t trk = 0; trk < tracks.size(); trk++) {
+                raw_track_decoder dec = decoder(trk);
+                while (dec.next(ev))
+                    f(ev);
+            }
+        }
+
+        // Like for_each_event, for modifying events in place. Throws if the
+        // data is not writable and validates all tracks before f is called,
+        // so nothing is modified if the data is malformed.
+        template<typename F>
+        void modify_each_event(F&& f) {
+            prepare_modify();
+            for_each_event(std::forward<F>(f));
+        }
+    private:
+        void prepare_modify() const;
+
+        uint16_t midi_type;
+        uint16_t time_division;
+        bool writable;
+        // begin and end of the event data of each track
+        std::vector<std::pair<uint8_t *, uint8_t *>> tracks;
+    };
+
+    // Maps a MIDI file for editing its raw bytes in place. Changes are
+    // written straight into the mapping, call sync() to flush them to disk.
+    class mapped_midi_file {
+    public:
+        explicit mapped_midi_file(const std::filesystem::path& file_path,
+                bool writable = true)
+            : mapping(file_path, writable),
+            raw_data(mapping.data(), mapping.size(), mapping.is_writable()) {}
+
+        raw_midi_data& raw() { return raw_data; }
+        const raw_midi_data& raw() const { return raw_data; }
+        void sync() { mapping.sync(); }
+    private:
+        mapped_file mapping;
+        raw_midi_data raw_data;
+    };
+
+    // Byte to byte mappings of channel message fields, each with a 128 entry
+    // table per channel. All tables are indexed by the original channel, the
+    // channel mapping is applied last. Default constructed maps are identity.
+    struct channel_message_map {
+        using table = std::array<uint8_t, 128>;
+
+        channel_message_map();
+
+        // keys of note on, note off and note aftertouch
+        std::array<table, 16> key;
+        // note on velocities except 0 (note off), results are at least 1
+        std::array<table, 16> velocity;
+        std::array<table, 16> program;
+        std::array<uint8_t, 16> channel;
+
+        // helpers filling the tables of the channels set in channel_mask
+        void transpose(int semitones, uint16_t channel_mask = 0xFFFF);
+        void scale_velocity(double factor, uint16_t channel_mask = 0xFFFF);
+
+        // one pass over the matching events, skipping tables which are identity
+        void apply(midi_track& mtrk) const;
+        void apply(midi_file& mf) const;
+        // rewrites the bytes in place, see raw_midi_data::modify_each_event
+        void apply(raw_midi_data& raw) const;
+    };
+
+    //=========================================================================
+
+    // Writes a growing MIDI file incrementally, e.g. for long recordings.
+    // Events passed to append() are buffered and written to the end of the
+    // last MTrk chunk by flush(), which then patches the chunk length and the
+    // header in place. The file is a valid MIDI file after every flush.
+    class midi_append_writer {
+    public:
+        // creates a new file with a single empty track
+        midi_append_writer(const std::filesystem::path& file_path,
+                uint16_t time_division, uint16_t midi_type = 1);
+        // opens an existing file and continues its last track
+        explicit midi_append_writer(const std::filesystem::path& file_path);
+        midi_append_writer(const midi_append_writer&) = delete;
+        midi_append_writer& operator=(const midi_append_writer&) = delete;
+        // flushes pending events, errors are ignored
+        ~midi_append_writer();
+
+        // events have to be appended in ascending order of ticks,
+        // end of track events are ignored as the writer manages them
+        void append(const midi_event& ev);
+        // finishes the current track and starts a new one (type 1 only)
+        void new_track();
+        void flush();
+
+        uint32_t get_last_tick() const { return last_event_time; }
+        size_t get_num_tracks() const { return num_tracks; }
+    private:
+        void write_at(uint64_t pos, const uint8_t *data, size_t size);
+
+        std::fstream file;
+        std::vector<uint8_t> pending;
+        uint16_t midi_type;
+        uint16_t num_tracks;
+        uint64_t chunk_len_pos;
+        uint64_t eot_pos;
+        uint32_t last_event_time;
+        uint8_t running_status;
+    };
+
+    //=========================================================================
+
+    enum class diff_op_type {
+        Insert, Remove, Modify
+    };
+
+    struct diff_op {
+        diff_op_type type;
+        size_t track;
+        // Remove, Modify: position of the event in the old track.
+        // Insert: position in the old track the event is inserted before.
+        size_t index;
+        // position of the new event in the new track, unused for Remove
+        size_t new_index;
+        // the new event, nullptr for Remove
+        std::unique_ptr<midi_event> event;
+        // Remove, Modify: hash of the ticks, kind and data of the old event
+        uint64_t old_fingerprint;
+    };
+
+    // Changes from one version of a file to another, see diff_files()
+    struct midi_patch {
+        uint16_t old_time_division;
+        uint16_t time_division;
+        size_t old_num_tracks;
+        size_t num_tracks;
+        // number of events of each old track
+        std::vector<size_t> old_track_sizes;
+        // ordered by track and index
+        std::vector<diff_op> ops;
+
+        bool empty() const;
+        // Turns the old file into the new one. All ops are checked against
+        // the time division, the track sizes and the old events they replace
+        // or remove before anything is changed, mf is left untouched if they
+        // don't match.
+        void apply(midi_file& mf) const;
+    };
+
+    // Compares two files track by track. Events are equal if their ticks,
+    // kind and data are equal. Common prefixes and suffixes of tracks are
+    // skipped, the rest is aligned with Myers' diff algorithm in linear
+    // space. Removed and inserted events of the same kind at the same place
+    // are reported as modifications. Tracks are compared in parallel.
+    midi_patch diff_files(const midi_file& older, const midi_file& newer);
+
     //=========================================================================
     
     class xcept : public std::exception {
@@ -0,0 +1,54 @@
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "cppmidi.h"
+
+/* This example program demonstrates how to apply an instrument
+ * mapping directly to the bytes of a MIDI file. Unlike map_instruments,
+ * the file is not loaded into objects and not rewritten. This works for
+ * all edits which do not change the size of an event. */
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: ./map_instruments_inplace <file.mid> [from_instr:to_instr]..." << std::endl;
+        return 1;
+    }
+
+    std::vector<int> inst_map(128, -1);
+
+    for (int i = 2; i < argc; i++) {
+        const std::string v(argv[i]);
+        const auto seperator_pos = v.find(":");
+        if (seperator_pos == std::string::npos || seperator_pos == 0 || seperator_pos == v.size() - 1) {
+            std::cerr << "Warning! Ignored malformed argument: " << v << std::endl;
+            continue;
+        }
+
+        int from = std::stoi(v.substr(0, seperator_pos));
+        int to = std::stoi(v.substr(seperator_pos + 1));
+
+        inst_map.at(static_cast<size_t>(from)) = to;
+    }
+
+    try {
+        /* Map the file for writing. Only the header and chunk table are parsed here. */
+        cppmidi::mapped_midi_file mmf(argv[1]);
+
+        /* Decode all events in place and modify program change data bytes.
+         * All tracks are checked first, so a broken file is left untouched. */
+        mmf.raw().modify_each_event([&](cppmidi::raw_event& ev) {
+            if (!ev.is_channel_message() || ev.message_type() != 0xC)
+                return;
+            int mapping = inst_map.at(ev.data[0]);
+            if (mapping != -1)
+                ev.data[0] = static_cast<uint8_t>(mapping & 0x7F);
+        });
+
+        /* make sure changes are written to disk */
+        mmf.sync();
+    } catch (const cppmidi::xcept& ex) {
+        /* If an error occurs, cppmidi will throw an exception of type xcept */
+        std::cerr << "cppmidi lib error:" << std::endl << ex.what() << std::endl;
+    }
+}
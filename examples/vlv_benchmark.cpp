@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "cppmidi.h"
+
+/* This example program compares the vector based VLV functions the
+ * library used before (copied below as they were) with the allocation free
+ * primitives (encode_vlv, decode_vlv, decode_vlvs) */
+
+// converts an uint to a [v]ariable [l]ength [v]alue
+static std::vector<uint8_t> old_len2vlv(uint64_t len) {
+    if (len >= (1uLL << 28)) {
+        // 5 byte vlv
+        std::vector<uint8_t> retval = {
+            static_cast<uint8_t>((len >> 28) | 0x80),
+            static_cast<uint8_t>(((len >> 21) & 0x7F) | 0x80),
+            static_cast<uint8_t>(((len >> 14) & 0x7F) | 0x80),
+            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
+            static_cast<uint8_t>(len & 0x7F)
+        };
+        return retval;
+    } else if (len >= (1 << 21)) {
+        // 4 byte vlv
+        std::vector<uint8_t> retval = {
+            static_cast<uint8_t>((len >> 21) | 0x80),
+            static_cast<uint8_t>(((len >> 14) & 0x7F) | 0x80),
+            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
+            static_cast<uint8_t>(len & 0x7F)
+        };
+        return retval;
+    } else if (len >= (1 << 14)) {
+        // 3 byte vlv
+        std::vector<uint8_t> retval = {
+            static_cast<uint8_t>((len >> 14) | 0x80),
+            static_cast<uint8_t>(((len >> 7) & 0x7F) | 0x80),
+            static_cast<uint8_t>(len & 0x7F)
+        };
+        return retval;
+    } else if (len >= (1 << 7)) {
+        // 2 byte vlv
+        std::vector<uint8_t> retval = {
+            static_cast<uint8_t>((len >> 7) | 0x80),
+            static_cast<uint8_t>(len & 0x7F)
+        };
+        return retval;
+    } else {
+        // 1 byte vlv
+        std::vector<uint8_t> retval = {
+            static_cast<uint8_t>(len & 0x7F)
+        };
+        return retval;
+    }
+}
+
+static uint32_t old_read_vlv(const std::vector<uint8_t>& midi_data, size_t& fpos) {
+    uint32_t retval = 0;
+    do {
+        if (retval >= 0x10000000)
+            throw cppmidi::xcept("Failed to read VLV (too big) at 0x%zx", fpos);
+        retval = static_cast<uint32_t>((midi_data.at(fpos) & 0x7F) |
+                (retval << 7));
+        // range check below is not required because we already checked it
+    } while (midi_data[fpos++] & 0x80);
+    return retval;
+}
+
+template<typename F>
+static double measure(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(stop - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+
+    /* delta times are mostly small, with a few big ones */
+    std::mt19937 rng(1);
+    std::vector<uint32_t> values(count);
+    for (uint32_t& v : values) {
+        switch (rng() % 16) {
+        case 0: v = rng() % 0x10000000; break;
+        case 1: case 2: v = rng() % 0x4000; break;
+        default: v = rng() % 0x80; break;
+        }
+    }
+
+    std::vector<uint8_t> data;
+    double t_len2vlv = measure([&]() {
+        for (uint32_t v : values) {
+            std::vector<uint8_t> vlv = old_len2vlv(v);
+            data.insert(data.end(), vlv.begin(), vlv.end());
+        }
+    });
+
+    std::vector<uint8_t> data2(count * cppmidi::max_vlv_size);
+    size_t size = 0;
+    double t_encode = measure([&]() {
+        for (uint32_t v : values)
+            size += cppmidi::encode_vlv(v, data2.data() + size);
+    });
+    data2.resize(size);
+
+    std::vector<uint32_t> decoded(count);
+    double t_read_vlv = measure([&]() {
+        size_t fpos = 0;
+        for (size_t i = 0; i < count; i++)
+            decoded[i] = old_read_vlv(data, fpos);
+    });
+    bool ok = decoded == values;
+
+    /* clear the results, so each decoder has to produce them itself */
+    std::fill(decoded.begin(), decoded.end(), 0xFFFFFFFF);
+    double t_decode = measure([&]() {
+        const uint8_t *pos = data2.data();
+        const uint8_t *end = pos + data2.size();
+        for (size_t i = 0; i < count; i++)
+            pos += cppmidi::decode_vlv(pos, end, decoded[i]);
+    });
+    ok = ok && decoded == values;
+
+    std::fill(decoded.begin(), decoded.end(), 0xFFFFFFFF);
+    double t_decode_bulk = measure([&]() {
+        cppmidi::decode_vlvs(data2.data(), data2.data() + data2.size(), decoded.data(), count);
+    });
+    ok = ok && decoded == values && data == data2;
+
+    std::cout << count << " VLVs, " << data.size() << " bytes" << std::endl;
+    std::cout << "old len2vlv:  " << t_len2vlv << " ms" << std::endl;
+    std::cout << "encode_vlv:   " << t_encode << " ms" << std::endl;
+    std::cout << "old read_vlv: " << t_read_vlv << " ms" << std::endl;
+    std::cout << "decode_vlv:   " << t_decode << " ms" << std::endl;
+    std::cout << "decode_vlvs:  " << t_decode_bulk << " ms" << std::endl;
+    if (!ok) {
+        std::cerr << "results differ" << std::endl;
+        return 1;
+    }
+}